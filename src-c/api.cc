@@ -1,7 +1,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <cstdio>
+#include <cstring>
 #include <string>
+#include <vector>
 #include <node_api.h>
 #include "matrix-control.h"
 
@@ -61,7 +63,65 @@ namespace ws2812drawCApi
         return brightness8;
     }
 
-    ws2811_led_t *convertToColorArray(napi_env env, dimensions_t dimensions, napi_value colorsInputArray)
+    int convertTiming(napi_env env, napi_value argValue)
+    {
+        napi_status status;
+        int32_t timing;
+        status = napi_get_value_int32(env, argValue, &timing);
+        if (didFail(env, status, "Failed to convert timing argument into int32."))
+        {
+            return WS2811_TIMING_DEFAULT;
+        }
+
+        return timing;
+    }
+
+    int convertLayout(napi_env env, napi_value argValue)
+    {
+        napi_status status;
+        int32_t layout;
+        status = napi_get_value_int32(env, argValue, &layout);
+        if (didFail(env, status, "Failed to convert layout argument into int32."))
+        {
+            return LED_LAYOUT_DEFAULT;
+        }
+
+        return layout;
+    }
+
+    napi_value setBrightnessCallback(napi_env env, napi_callback_info info)
+    {
+        napi_value setBrightnessReturnValue;
+        napi_status status;
+
+        size_t argc = 1;
+        napi_value argv[1];
+        status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+        if (didFail(env, status, "Failed to retrieve arguments given to setBrightnessCallback."))
+        {
+            return nullptr;
+        }
+
+        uint8_t brightness = convertBrightness(env, argv[0]);
+
+        const bool setBrightnessResult = ledSetBrightness(brightness);
+
+        if (!setBrightnessResult)
+        {
+            napi_throw_error(env, NULL, "setBrightness failed: must call initMatrix first.");
+            return nullptr;
+        }
+
+        status = napi_get_boolean(env, setBrightnessResult, &setBrightnessReturnValue);
+        if (didFail(env, status, "Failed to convert setBrightness result into boolean."))
+        {
+            return nullptr;
+        }
+        return setBrightnessReturnValue;
+    }
+
+    // Fills colors, which holds height * width LEDs, from the input array
+    bool convertColors(napi_env env, dimensions_t dimensions, napi_value colorsInputArray, ws2811_led_t *colors)
     {
         napi_status status;
 
@@ -69,17 +129,15 @@ namespace ws2812drawCApi
         status = napi_get_array_length(env, colorsInputArray, &colorsArrayLength);
         if (didFail(env, status, "Failed to get array length of input colors array."))
         {
-            return nullptr;
+            return false;
         }
 
         if (colorsArrayLength != dimensions.height * dimensions.width)
         {
             napi_throw_error(env, NULL, "Input colors array should have a length equal to height * width.");
-            return nullptr;
+            return false;
         }
 
-        ws2811_led_t *colors;
-        colors = (ws2811_led_t *)malloc(sizeof(ws2811_led_t) * colorsArrayLength);
         // help with arrays: https://github.com/nodejs/help/issues/1154#issuecomment-372632449
         for (uint32_t index = 0; index < colorsArrayLength; index++)
         {
@@ -89,7 +147,7 @@ namespace ws2812drawCApi
             {
                 std::string errorMessage = "Failed to get colors array element at index " + std::to_string(index) + ".";
                 napi_throw_error(env, NULL, errorMessage.c_str());
-                return nullptr;
+                return false;
             }
 
             uint32_t elementColor;
@@ -98,11 +156,36 @@ namespace ws2812drawCApi
             {
                 std::string errorMessage = "Failed to convert colors array element at index " + std::to_string(index) + " into uint32.";
                 napi_throw_error(env, NULL, errorMessage.c_str());
-                return nullptr;
+                return false;
             }
             colors[index] = (ws2811_led_t)elementColor;
         }
 
+        return true;
+    }
+
+    // Colors of the frame being converted, kept between calls so it is only allocated once
+    std::vector<ws2811_led_t> scratchColors;
+
+    // The frame buffer of an initialized matrix filled with the colors. They are converted into
+    // scratchColors first, so an invalid element leaves the previous frame untouched.
+    ws2811_led_t *convertToFrameBuffer(napi_env env, napi_value colorsInputArray, const char *notInitializedMessage)
+    {
+        ws2811_led_t *colors = ledFrameBuffer();
+        if (!colors)
+        {
+            napi_throw_error(env, NULL, notInitializedMessage);
+            return nullptr;
+        }
+
+        const dimensions_t dimensions = getInitializedDimensions();
+        scratchColors.resize(dimensions.width * dimensions.height);
+        if (!convertColors(env, dimensions, colorsInputArray, scratchColors.data()))
+        {
+            return nullptr;
+        }
+
+        memcpy(colors, scratchColors.data(), sizeof(ws2811_led_t) * scratchColors.size());
         return colors;
     }
 
@@ -120,14 +203,14 @@ namespace ws2812drawCApi
             return nullptr;
         }
 
-        dimensions_t initDimensions = getInitializedDimensions();
-
-        ws2811_led_t *colors = convertToColorArray(env, initDimensions, argv[0]);
+        ws2811_led_t *colors = convertToFrameBuffer(env, argv[0], "drawFrame failed: must call initMatrix first.");
+        if (!colors)
+        {
+            return nullptr;
+        }
 
         const bool drawFrameResult = ledDrawFrame(colors);
 
-        free(colors);
-
         if (!drawFrameResult)
         {
             napi_throw_error(env, NULL, "drawFrame failed: must call initMatrix first.");
@@ -142,6 +225,111 @@ namespace ws2812drawCApi
         return DrawFrameReturnValue;
     }
 
+    napi_value drawFrameAsyncCallback(napi_env env, napi_callback_info info)
+    {
+        napi_value drawFrameAsyncReturnValue;
+        napi_status status;
+
+        size_t argc = 1;
+        napi_value argv[1];
+        status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+        if (didFail(env, status, "Failed to retrieve arguments given to drawFrameAsyncCallback."))
+        {
+            return nullptr;
+        }
+
+        ws2811_led_t *colors = convertToFrameBuffer(env, argv[0], "drawFrameAsync failed: must call initMatrix first.");
+        if (!colors)
+        {
+            return nullptr;
+        }
+
+        ws2811_fence_t fence = 0;
+        const bool drawFrameResult = ledDrawFrameAsync(colors, &fence);
+
+        if (!drawFrameResult)
+        {
+            napi_throw_error(env, NULL, "drawFrameAsync failed: must call initMatrix first.");
+            return nullptr;
+        }
+
+        status = napi_create_int64(env, (int64_t)fence, &drawFrameAsyncReturnValue);
+        if (didFail(env, status, "Failed to convert drawFrameAsync fence into number."))
+        {
+            return nullptr;
+        }
+        return drawFrameAsyncReturnValue;
+    }
+
+    ws2811_fence_t convertFence(napi_env env, napi_callback_info info)
+    {
+        napi_status status;
+
+        size_t argc = 1;
+        napi_value argv[1];
+        status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+        if (didFail(env, status, "Failed to retrieve frame fence argument."))
+        {
+            return 0;
+        }
+
+        int64_t fence;
+        status = napi_get_value_int64(env, argv[0], &fence);
+        if (didFail(env, status, "Failed to convert frame fence argument into int64."))
+        {
+            return 0;
+        }
+
+        return (ws2811_fence_t)fence;
+    }
+
+    napi_value pollFrameCallback(napi_env env, napi_callback_info info)
+    {
+        napi_value pollFrameReturnValue;
+        napi_status status;
+
+        ws2811_fence_t fence = convertFence(env, info);
+
+        const bool pollFrameResult = ledPollFrame(fence);
+
+        status = napi_get_boolean(env, pollFrameResult, &pollFrameReturnValue);
+        if (didFail(env, status, "Failed to convert pollFrame result into boolean."))
+        {
+            return nullptr;
+        }
+        return pollFrameReturnValue;
+    }
+
+    napi_value waitFrameCallback(napi_env env, napi_callback_info info)
+    {
+        napi_value waitFrameReturnValue;
+        napi_status status;
+
+        ws2811_fence_t fence = convertFence(env, info);
+
+        const bool waitFrameResult = ledWaitFrame(fence);
+
+        status = napi_get_boolean(env, waitFrameResult, &waitFrameReturnValue);
+        if (didFail(env, status, "Failed to convert waitFrame result into boolean."))
+        {
+            return nullptr;
+        }
+        return waitFrameReturnValue;
+    }
+
+    napi_value skippedFrameCountCallback(napi_env env, napi_callback_info info)
+    {
+        napi_value skippedFrameCountReturnValue;
+        napi_status status;
+
+        status = napi_create_int64(env, (int64_t)ledSkippedFrameCount(), &skippedFrameCountReturnValue);
+        if (didFail(env, status, "Failed to convert skipped frame count into number."))
+        {
+            return nullptr;
+        }
+        return skippedFrameCountReturnValue;
+    }
+
     dimensions_t getDimensionArgs(napi_env env, napi_value argv[2])
     {
         napi_status status;
@@ -163,6 +351,87 @@ namespace ws2812drawCApi
         };
     }
 
+    int convertOutputs(napi_env env, napi_value argValue)
+    {
+        napi_status status;
+        int32_t outputs;
+        status = napi_get_value_int32(env, argValue, &outputs);
+        if (didFail(env, status, "Failed to convert outputs argument into int32."))
+        {
+            return LED_OUTPUT_SINGLE;
+        }
+
+        return outputs;
+    }
+
+    // Panels come as a flat array of x, y, width, height and layout for each panel
+    panel_t *convertPanels(napi_env env, napi_value panelsInputArray, uint32_t *panelCount)
+    {
+        const uint32_t fieldCount = 5;
+        napi_status status;
+
+        uint32_t panelsArrayLength;
+        status = napi_get_array_length(env, panelsInputArray, &panelsArrayLength);
+        if (didFail(env, status, "Failed to get array length of input panels array."))
+        {
+            return nullptr;
+        }
+
+        if (!panelsArrayLength || panelsArrayLength % fieldCount)
+        {
+            napi_throw_error(env, NULL, "Input panels array should have 5 values for each of at least one panel.");
+            return nullptr;
+        }
+
+        *panelCount = panelsArrayLength / fieldCount;
+        panel_t *panels = (panel_t *)malloc(sizeof(panel_t) * *panelCount);
+        if (!panels)
+        {
+            napi_throw_error(env, NULL, "Failed to allocate panels array.");
+            return nullptr;
+        }
+
+        for (uint32_t index = 0; index < panelsArrayLength; index++)
+        {
+            napi_value inputArrayElementValue;
+            uint32_t value;
+            status = napi_get_element(env, panelsInputArray, index, &inputArrayElementValue);
+            if (status == napi_ok)
+            {
+                status = napi_get_value_uint32(env, inputArrayElementValue, &value);
+            }
+            if (status != napi_ok)
+            {
+                std::string errorMessage = "Failed to convert panels array element at index " + std::to_string(index) + " into uint32.";
+                napi_throw_error(env, NULL, errorMessage.c_str());
+                free(panels);
+                return nullptr;
+            }
+
+            panel_t *panel = &panels[index / fieldCount];
+            switch (index % fieldCount)
+            {
+            case 0:
+                panel->x = value;
+                break;
+            case 1:
+                panel->y = value;
+                break;
+            case 2:
+                panel->width = value;
+                break;
+            case 3:
+                panel->height = value;
+                break;
+            default:
+                panel->layout = (int)value;
+                break;
+            }
+        }
+
+        return panels;
+    }
+
     napi_value drawStillCallback(napi_env env, napi_callback_info info)
     {
         napi_value drawStillReturnValue;
@@ -180,11 +449,18 @@ namespace ws2812drawCApi
 
         uint8_t brightness = convertBrightness(env, argv[2]);
 
-        ws2811_led_t *colors = convertToColorArray(env, dimensions, argv[3]);
-
-        const bool drawStillResult = drawStill(dimensions, brightness, colors);
+        // with the driver ready the colors go straight into its frame buffer, as for drawFrame
+        bool drawStillResult = prepareStill(dimensions, brightness);
+        if (drawStillResult)
+        {
+            ws2811_led_t *colors = convertToFrameBuffer(env, argv[3], "drawStill failed: matrix was not initialized.");
+            if (!colors)
+            {
+                return nullptr;
+            }
 
-        free(colors);
+            drawStillResult = ledDrawFrame(colors);
+        }
 
         status = napi_get_boolean(env, drawStillResult, &drawStillReturnValue);
         if (didFail(env, status, "Failed to convert drawStill result into boolean."))
@@ -202,8 +478,8 @@ namespace ws2812drawCApi
         napi_value matrixInitReturnValue;
         napi_status status;
 
-        size_t argc = 3;
-        napi_value argv[3];
+        size_t argc = 7;
+        napi_value argv[7];
         status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
         if (didFail(env, status, "Failed to retrieve arguments given to initMatrixCallback."))
         {
@@ -214,7 +490,45 @@ namespace ws2812drawCApi
 
         uint8_t brightness = convertBrightness(env, argv[2]);
 
-        const bool initMatrixResult = ledInit(dimensions, brightness);
+        // the timing profile is optional
+        int timing = WS2811_TIMING_DEFAULT;
+        if (argc > 3)
+        {
+            timing = convertTiming(env, argv[3]);
+        }
+
+        // so is the layout of the strip on the panel
+        int layout = LED_LAYOUT_DEFAULT;
+        if (argc > 4)
+        {
+            layout = convertLayout(env, argv[4]);
+        }
+
+        // without a list of panels the whole canvas is a single panel with the given layout
+        panel_t wholeCanvas = {0, 0, dimensions.width, dimensions.height, layout};
+        const panel_t *panels = &wholeCanvas;
+        uint32_t panelCount = 1;
+        panel_t *panelArgs = nullptr;
+        if (argc > 5)
+        {
+            panelArgs = convertPanels(env, argv[5], &panelCount);
+            if (!panelArgs)
+            {
+                return nullptr;
+            }
+            panels = panelArgs;
+        }
+
+        // and the outputs the panels are split across
+        int outputs = LED_OUTPUT_SINGLE;
+        if (argc > 6)
+        {
+            outputs = convertOutputs(env, argv[6]);
+        }
+
+        const bool initMatrixResult = ledInit(dimensions, brightness, timing, panels, panelCount, outputs);
+
+        free(panelArgs);
 
         if (!initMatrixResult)
         {
@@ -251,6 +565,11 @@ namespace ws2812drawCApi
         napi_status status;
         napi_value cleanUpFunction;
         napi_value drawFrameFunction;
+        napi_value drawFrameAsyncFunction;
+        napi_value setBrightnessFunction;
+        napi_value pollFrameFunction;
+        napi_value waitFrameFunction;
+        napi_value skippedFrameCountFunction;
         napi_value drawStillFunction;
         napi_value initMatrixFunction;
         napi_value testFunction;
@@ -303,6 +622,66 @@ namespace ws2812drawCApi
             return nullptr;
         }
 
+        status = napi_create_function(env, nullptr, 0, drawFrameAsyncCallback, nullptr, &drawFrameAsyncFunction);
+        if (didFail(env, status, "Failed to create function for drawFrameAsyncCallback."))
+        {
+            return nullptr;
+        }
+
+        status = napi_set_named_property(env, exports, "drawFrameAsync", drawFrameAsyncFunction);
+        if (didFail(env, status, "Failed to attach drawFrameAsync to exports."))
+        {
+            return nullptr;
+        }
+
+        status = napi_create_function(env, nullptr, 0, pollFrameCallback, nullptr, &pollFrameFunction);
+        if (didFail(env, status, "Failed to create function for pollFrameCallback."))
+        {
+            return nullptr;
+        }
+
+        status = napi_set_named_property(env, exports, "pollFrame", pollFrameFunction);
+        if (didFail(env, status, "Failed to attach pollFrame to exports."))
+        {
+            return nullptr;
+        }
+
+        status = napi_create_function(env, nullptr, 0, waitFrameCallback, nullptr, &waitFrameFunction);
+        if (didFail(env, status, "Failed to create function for waitFrameCallback."))
+        {
+            return nullptr;
+        }
+
+        status = napi_set_named_property(env, exports, "waitFrame", waitFrameFunction);
+        if (didFail(env, status, "Failed to attach waitFrame to exports."))
+        {
+            return nullptr;
+        }
+
+        status = napi_create_function(env, nullptr, 0, setBrightnessCallback, nullptr, &setBrightnessFunction);
+        if (didFail(env, status, "Failed to create function for setBrightnessCallback."))
+        {
+            return nullptr;
+        }
+
+        status = napi_set_named_property(env, exports, "setBrightness", setBrightnessFunction);
+        if (didFail(env, status, "Failed to attach setBrightness to exports."))
+        {
+            return nullptr;
+        }
+
+        status = napi_create_function(env, nullptr, 0, skippedFrameCountCallback, nullptr, &skippedFrameCountFunction);
+        if (didFail(env, status, "Failed to create function for skippedFrameCountCallback."))
+        {
+            return nullptr;
+        }
+
+        status = napi_set_named_property(env, exports, "skippedFrameCount", skippedFrameCountFunction);
+        if (didFail(env, status, "Failed to attach skippedFrameCount to exports."))
+        {
+            return nullptr;
+        }
+
         status = napi_create_function(env, nullptr, 0, testCallback, nullptr, &testFunction);
         if (didFail(env, status, "Failed to create function for testCallback."))
         {
@@ -0,0 +1,212 @@
+/*
+ * Measures how long encoding a frame takes against the LED count, on one thread and spread
+ * over worker threads the way ws2811_render does for long frames.  Runs without LED hardware.
+ *
+ * Build and run with: npm run benchmark:encode
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../ws2811.h"
+#include "../encoder.h"
+#include "../workers.h"
+
+#define MAX_THREADS     4
+#define CHUNK_LEDS      512
+#define REPEATS         200
+
+typedef struct
+{
+    ws2811_channel_t *channel;
+    ws2811_encoder_t encoder;
+    const uint32_t *symbol_lut;
+    uint32_t *words;
+    uint8_t *color_bytes[MAX_THREADS];
+    int chunk_count;
+    int chunk_first[64];
+    int chunk_leds[64];
+} frame_t;
+
+static uint64_t timestamp_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return ((uint64_t)t.tv_sec * 1000000000) + t.tv_nsec;
+}
+
+static void symbol_lut_init(uint32_t *lut)
+{
+    int value, bit;
+
+    for (value = 0; value < 256; value++)
+    {
+        lut[value] = 0;
+        for (bit = 7; bit >= 0; bit--)
+        {
+            lut[value] = (lut[value] << 3) | (((value >> bit) & 1) ? 0x6 : 0x4);
+        }
+    }
+}
+
+static void encode_chunk(void *arg, int index, int thread)
+{
+    frame_t *frame = arg;
+    const int first = frame->chunk_first[index];
+    const int leds = frame->chunk_leds[index];
+
+    // RGB chunks start every CHUNK_LEDS LEDs, which is a multiple of 4 and so word aligned
+    ws2811_prestage(frame->channel, first, leds, frame->color_bytes[thread]);
+    frame->encoder(frame->color_bytes[thread], leds * 3, frame->symbol_lut, frame->words + ((first * 72 / 32) * 2),
+                   0);
+}
+
+static void split_frame(frame_t *frame, int threads)
+{
+    const int count = frame->channel->count;
+    int first;
+
+    frame->chunk_count = 0;
+    for (first = 0; first < count; first += CHUNK_LEDS)
+    {
+        frame->chunk_first[frame->chunk_count] = first;
+        frame->chunk_leds[frame->chunk_count] = (count - first < CHUNK_LEDS) ? count - first : CHUNK_LEDS;
+        frame->chunk_count++;
+    }
+
+    if (threads == 1)
+    {
+        frame->chunk_first[0] = 0;
+        frame->chunk_leds[0] = count;
+        frame->chunk_count = 1;
+    }
+}
+
+static double time_frame(frame_t *frame, ws2811_workers_t *workers)
+{
+    uint64_t best = UINT64_MAX;
+    int i, j;
+
+    for (i = 0; i < REPEATS; i++)
+    {
+        const uint64_t start = timestamp_ns();
+
+        if (workers)
+        {
+            ws2811_workers_run(workers, encode_chunk, frame, frame->chunk_count);
+        }
+        else
+        {
+            for (j = 0; j < frame->chunk_count; j++)
+            {
+                encode_chunk(frame, j, 0);
+            }
+        }
+
+        const uint64_t elapsed = timestamp_ns() - start;
+        if (elapsed < best)
+        {
+            best = elapsed;
+        }
+    }
+
+    return best / 1000.0;
+}
+
+int main(void)
+{
+    static const int counts[] = {256, 512, 1024, 2048, 4096, 8192, 16384, 32768};
+    ws2811_workers_t *workers[MAX_THREADS] = {NULL};
+    uint32_t symbol_lut[256];
+    uint8_t gamma[256], color_lut[256];
+    int c, t, i;
+
+    symbol_lut_init(symbol_lut);
+    for (i = 0; i < 256; i++)
+    {
+        gamma[i] = i;
+        color_lut[i] = (i * 201) >> 8;
+    }
+    for (t = 2; t <= MAX_THREADS; t++)
+    {
+        workers[t - 1] = ws2811_workers_create(t - 1);
+    }
+
+    printf("%ld CPUs online, best of %d frames, PWM RGB\n\n", sysconf(_SC_NPROCESSORS_ONLN), REPEATS);
+    printf("%8s", "LEDs");
+    for (t = 1; t <= MAX_THREADS; t++)
+    {
+        printf(" %9d thr", t);
+    }
+    printf("   speedup\n");
+
+    for (c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++)
+    {
+        ws2811_channel_t channel;
+        frame_t frame;
+        double base = 0, best = 0;
+
+        memset(&channel, 0, sizeof(channel));
+        channel.count = counts[c];
+        channel.strip_type = WS2811_STRIP_GRB;
+        channel.rshift = 8;
+        channel.gshift = 16;
+        channel.bshift = 0;
+        channel.brightness = 200;
+        channel.gamma = gamma;
+        channel.color_lut = color_lut;
+        channel.leds = malloc(sizeof(ws2811_led_t) * channel.count);
+        for (i = 0; i < channel.count; i++)
+        {
+            channel.leds[i] = (uint32_t)i * 2654435761u;
+        }
+
+        memset(&frame, 0, sizeof(frame));
+        frame.channel = &channel;
+        frame.encoder = ws2811_encoder_select(WS2811_LAYOUT_PWM, 0);
+        frame.symbol_lut = symbol_lut;
+        frame.words = calloc((channel.count * 72 / 32) + 2, 2 * sizeof(uint32_t));
+        for (t = 0; t < MAX_THREADS; t++)
+        {
+            frame.color_bytes[t] = malloc((channel.count * 4) + WS2811_PRESTAGE_SLACK);
+        }
+
+        printf("%8d", channel.count);
+        for (t = 1; t <= MAX_THREADS; t++)
+        {
+            split_frame(&frame, t);
+            const double us = time_frame(&frame, workers[t - 1]);
+
+            if (t == 1)
+            {
+                base = us;
+                best = us;
+            }
+            else if (workers[t - 1] && (us < best))
+            {
+                best = us;
+            }
+            printf(" %10.1fus", us);
+        }
+        printf("   %6.2fx\n", base / best);
+
+        for (t = 0; t < MAX_THREADS; t++)
+        {
+            free(frame.color_bytes[t]);
+        }
+        free(frame.words);
+        free(channel.leds);
+    }
+
+    for (t = 0; t < MAX_THREADS; t++)
+    {
+        ws2811_workers_destroy(workers[t]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * Checks the vector bit-plane transpose of the parallel GPIO driver against the scalar one and
+ * measures both against the color bytes per channel.  Runs without LED hardware.
+ *
+ * Build and run with: npm run benchmark:transpose
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../encoder.h"
+
+#define REPEATS         200
+
+static uint64_t timestamp_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return ((uint64_t)t.tv_sec * 1000000000) + t.tv_nsec;
+}
+
+static double time_transpose(void (*transpose)(const uint8_t *, int, int, uint16_t *), const uint8_t *rows,
+                             int stride, int count, uint16_t *planes)
+{
+    uint64_t best = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < REPEATS; i++)
+    {
+        const uint64_t start = timestamp_ns();
+
+        transpose(rows, stride, count, planes);
+
+        const uint64_t elapsed = timestamp_ns() - start;
+        if (elapsed < best)
+        {
+            best = elapsed;
+        }
+    }
+
+    return best / 1000.0;
+}
+
+int main(void)
+{
+    static const int counts[] = {1, 15, 16, 17, 100, 900, 3000, 12000};
+    int c, i, failed = 0;
+
+    printf("best of %d frames, %d channels\n\n", REPEATS, WS2811_PLANE_CHANNELS);
+    printf("%8s %12s %12s   speedup\n", "bytes", "scalar", "vector");
+
+    for (c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++)
+    {
+        const int count = counts[c];
+        const int stride = count + 5;  // rows that do not start on a vector boundary
+        uint8_t *rows = malloc(stride * WS2811_PLANE_CHANNELS);
+        uint16_t *expected = malloc(sizeof(uint16_t) * count * 8);
+        uint16_t *planes = malloc(sizeof(uint16_t) * count * 8);
+
+        srand(count);
+        for (i = 0; i < stride * WS2811_PLANE_CHANNELS; i++)
+        {
+            rows[i] = rand();
+        }
+        // all bits of a channel set or clear catch planes that mix up rows
+        memset(rows + stride * 3, 0xff, count);
+        memset(rows + stride * 12, 0, count);
+
+        ws2811_transpose_planes_scalar(rows, stride, count, expected);
+        ws2811_transpose_planes(rows, stride, count, planes);
+        if (memcmp(expected, planes, sizeof(uint16_t) * count * 8))
+        {
+            printf("%8d planes differ from the scalar transpose\n", count);
+            failed = 1;
+        }
+        else
+        {
+            const double scalar = time_transpose(ws2811_transpose_planes_scalar, rows, stride, count, planes);
+            const double vector = time_transpose(ws2811_transpose_planes, rows, stride, count, planes);
+
+            printf("%8d %10.1fus %10.1fus   %6.2fx\n", count, scalar, vector, scalar / vector);
+        }
+
+        free(planes);
+        free(expected);
+        free(rows);
+    }
+
+    return failed;
+}
@@ -0,0 +1,831 @@
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include "encoder.h"
+
+// SSE2 is the baseline of the x86 paths, i386 builds without -msse2 use the scalar code
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define WS2811_X86_SIMD
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace
+{
+
+    // SPI sends bytes MSB first, so its words are stored big endian
+    template <int Layout>
+    inline uint32_t loadWord(const uint32_t *word)
+    {
+        return Layout == WS2811_LAYOUT_SPI ? be32toh(*word) : *word;
+    }
+
+    template <int Layout>
+    inline void storeWord(uint32_t *word, uint32_t value)
+    {
+        *word = Layout == WS2811_LAYOUT_SPI ? htobe32(value) : value;
+    }
+
+    /**
+     * Byte of a ws2811_led_t (little endian 0xWWRRGGBB) that holds each color, in strip order.
+     */
+    void stripByteIndexes(const ws2811_channel_t *channel, uint8_t byteIndex[4])
+    {
+        byteIndex[0] = channel->rshift / 8;
+        byteIndex[1] = channel->gshift / 8;
+        byteIndex[2] = channel->bshift / 8;
+        byteIndex[3] = channel->wshift / 8;
+    }
+
+    /**
+     * Shuffle control that turns 4 LEDs into their color bytes in strip order. Unused output
+     * bytes select 0x80, which every supported shuffle instruction turns into zero.
+     */
+    void buildShuffle(int colors, const uint8_t byteIndex[4], uint8_t shuffle[16])
+    {
+        memset(shuffle, 0x80, 16);
+        for (int led = 0; led < 4; led++)
+        {
+            for (int color = 0; color < colors; color++)
+            {
+                shuffle[led * colors + color] = led * 4 + byteIndex[color];
+            }
+        }
+    }
+
+    // True if the color_lut only scales by brightness, i.e. was built from an uncorrected gamma table
+    bool isScale(const uint8_t *lut, int scale)
+    {
+        for (int x = 0; x < 256; x++)
+        {
+            if (lut[x] != ((x * scale) >> 8))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void scaleBytesScalar(uint8_t *bytes, int count, int scale)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            bytes[i] = (bytes[i] * scale) >> 8;
+        }
+    }
+
+    void lookupBytesScalar(uint8_t *bytes, int count, const uint8_t *lut)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            bytes[i] = lut[bytes[i]];
+        }
+    }
+
+#if defined(WS2811_X86_SIMD)
+
+    __attribute__((target("ssse3"))) int swizzleSsse3(const ws2811_led_t *leds, int count, int colors,
+                                                     const uint8_t shuffleBytes[16], uint8_t *bytes)
+    {
+        const __m128i shuffle = _mm_loadu_si128((const __m128i *)shuffleBytes);
+        int i = 0;
+
+        for (; i + 4 <= count; i += 4)
+        {
+            const __m128i in = _mm_loadu_si128((const __m128i *)(leds + i));
+            _mm_storeu_si128((__m128i *)(bytes + i * colors), _mm_shuffle_epi8(in, shuffle));
+        }
+        return i;
+    }
+
+    __attribute__((target("avx2"))) int swizzleAvx2(const ws2811_led_t *leds, int count, int colors,
+                                                   const uint8_t shuffleBytes[16], uint8_t *bytes)
+    {
+        // the shuffle works within each 128-bit lane, so each lane packs 4 LEDs and 3 color
+        // strips then need their two 12 byte halves moved next to each other
+        const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)shuffleBytes));
+        const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+        int i = 0;
+
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256i out = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(leds + i)), shuffle);
+            if (colors == 3)
+            {
+                out = _mm256_permutevar8x32_epi32(out, compact);
+            }
+            _mm256_storeu_si256((__m256i *)(bytes + i * colors), out);
+        }
+        return i;
+    }
+
+    int scaleBytesSse2(uint8_t *bytes, int count, int scale)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i scale16 = _mm_set1_epi16(scale);
+        int i = 0;
+
+        for (; i + 16 <= count; i += 16)
+        {
+            const __m128i in = _mm_loadu_si128((const __m128i *)(bytes + i));
+            const __m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(in, zero), scale16), 8);
+            const __m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(in, zero), scale16), 8);
+            _mm_storeu_si128((__m128i *)(bytes + i), _mm_packus_epi16(lo, hi));
+        }
+        return i;
+    }
+
+    __attribute__((target("avx2"))) int scaleBytesAvx2(uint8_t *bytes, int count, int scale)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i scale16 = _mm256_set1_epi16(scale);
+        int i = 0;
+
+        for (; i + 32 <= count; i += 32)
+        {
+            const __m256i in = _mm256_loadu_si256((const __m256i *)(bytes + i));
+            const __m256i lo = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(in, zero), scale16), 8);
+            const __m256i hi = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(in, zero), scale16), 8);
+            _mm256_storeu_si256((__m256i *)(bytes + i), _mm256_packus_epi16(lo, hi));
+        }
+        return i;
+    }
+
+    bool hasAvx2()
+    {
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+    }
+
+    bool hasSsse3()
+    {
+        static const bool supported = __builtin_cpu_supports("ssse3");
+        return supported;
+    }
+
+    int swizzleVector(const ws2811_led_t *leds, int count, int colors, const uint8_t shuffle[16], uint8_t *bytes)
+    {
+        if (hasAvx2())
+        {
+            return swizzleAvx2(leds, count, colors, shuffle, bytes);
+        }
+        if (hasSsse3())
+        {
+            return swizzleSsse3(leds, count, colors, shuffle, bytes);
+        }
+        return 0;
+    }
+
+    int scaleBytesVector(uint8_t *bytes, int count, int scale)
+    {
+        return hasAvx2() ? scaleBytesAvx2(bytes, count, scale) : scaleBytesSse2(bytes, count, scale);
+    }
+
+    int lookupBytesVector(uint8_t *, int, const uint8_t *)
+    {
+        // no byte table lookup wider than 16 entries on x86
+        return 0;
+    }
+
+    /**
+     * Transposes 16 color bytes of each of the 16 rows at a time into bit-planes.
+     *
+     * @returns Number of bytes transposed per row, a multiple of 16.
+     */
+    int transposePlanesVector(const uint8_t *rows, int stride, int count, uint16_t *planes)
+    {
+        int i = 0;
+
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128i v[WS2811_PLANE_CHANNELS];
+
+            for (int row = 0; row < WS2811_PLANE_CHANNELS; row++)
+            {
+                v[row] = _mm_loadu_si128((const __m128i *)(rows + row * stride + i));
+            }
+
+            // each round interleaves row r with row r + 8, which rotates the 8 bit row and
+            // column index left by one, so after 4 rounds vector j holds byte j of every row
+            for (int round = 0; round < 4; round++)
+            {
+                __m128i t[WS2811_PLANE_CHANNELS];
+
+                for (int row = 0; row < 8; row++)
+                {
+                    t[2 * row] = _mm_unpacklo_epi8(v[row], v[row + 8]);
+                    t[2 * row + 1] = _mm_unpackhi_epi8(v[row], v[row + 8]);
+                }
+                memcpy(v, t, sizeof(v));
+            }
+
+            // the byte sign bits of every row make one plane, MSB first
+            for (int byte = 0; byte < 16; byte++)
+            {
+                uint16_t *plane = planes + (i + byte) * 8;
+                __m128i bits = v[byte];
+
+                for (int bit = 0; bit < 8; bit++)
+                {
+                    plane[bit] = (uint16_t)_mm_movemask_epi8(bits);
+                    bits = _mm_add_epi8(bits, bits);
+                }
+            }
+        }
+        return i;
+    }
+
+    // One color byte per 32-bit lane into its 24 symbol bits, bit i of the byte is the middle
+    // bit of the symbol at bits 3i..3i+2
+    inline __m128i spreadSymbols(__m128i b)
+    {
+        b = _mm_and_si128(_mm_or_si128(b, _mm_slli_epi32(b, 8)), _mm_set1_epi32(0x0000f00f));
+        b = _mm_and_si128(_mm_or_si128(b, _mm_slli_epi32(b, 4)), _mm_set1_epi32(0x000c30c3));
+        b = _mm_and_si128(_mm_or_si128(b, _mm_slli_epi32(b, 2)), _mm_set1_epi32(0x00249249));
+        return _mm_or_si128(_mm_slli_epi32(b, 1), _mm_set1_epi32(WS2811_SYMBOL_FRAME));
+    }
+
+    inline __m128i byteSwapWords(__m128i w)
+    {
+        const __m128i mask = _mm_set1_epi32(0x00ff00ff);
+        w = _mm_or_si128(_mm_slli_epi32(w, 16), _mm_srli_epi32(w, 16));
+        return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(w, mask), 8), _mm_srli_epi16(w, 8));
+    }
+
+    template <int Layout>
+    inline void storeWords(uint32_t *words, __m128i value)
+    {
+        if (Layout == WS2811_LAYOUT_PWM)
+        {
+            // the odd words belong to the other channel, which may be encoded at the same time
+            alignas(16) uint32_t lanes[4];
+
+            _mm_store_si128((__m128i *)lanes, value);
+            words[0] = lanes[0];
+            words[2] = lanes[1];
+            words[4] = lanes[2];
+            words[6] = lanes[3];
+        }
+        else
+        {
+            _mm_storeu_si128((__m128i *)words, Layout == WS2811_LAYOUT_SPI ? byteSwapWords(value) : value);
+        }
+    }
+
+    /**
+     * Encodes 16 color bytes at a time into 12 whole words, starting at a word boundary.
+     *
+     * @returns Number of bytes encoded, a multiple of 16.
+     */
+    template <int Layout, bool Invert>
+    int encodeVector(const uint8_t *bytes, int count, uint32_t *words)
+    {
+        const int wordStep = Layout == WS2811_LAYOUT_PWM ? 2 : 1;
+        const __m128i byteMask = _mm_set1_epi32(0xff);
+        const __m128i invertMask = _mm_set1_epi32(Invert ? -1 : 0);
+        int i = 0;
+
+        for (; i + 16 <= count; i += 16)
+        {
+            // lane g holds bytes 4g..4g+3, which make up words 3g..3g+2
+            const __m128i in = _mm_loadu_si128((const __m128i *)(bytes + i));
+            const __m128i s0 = spreadSymbols(_mm_and_si128(in, byteMask));
+            const __m128i s1 = spreadSymbols(_mm_and_si128(_mm_srli_epi32(in, 8), byteMask));
+            const __m128i s2 = spreadSymbols(_mm_and_si128(_mm_srli_epi32(in, 16), byteMask));
+            const __m128i s3 = spreadSymbols(_mm_srli_epi32(in, 24));
+            const __m128 a = _mm_castsi128_ps(_mm_xor_si128(_mm_or_si128(_mm_slli_epi32(s0, 8), _mm_srli_epi32(s1, 16)), invertMask));
+            const __m128 b = _mm_castsi128_ps(_mm_xor_si128(_mm_or_si128(_mm_slli_epi32(s1, 16), _mm_srli_epi32(s2, 8)), invertMask));
+            const __m128 c = _mm_castsi128_ps(_mm_xor_si128(_mm_or_si128(_mm_slli_epi32(s2, 24), s3), invertMask));
+
+            // a0 b0 c0 a1 | b1 c1 a2 b2 | c2 a3 b3 c3
+            const __m128 ab = _mm_unpacklo_ps(a, b);
+            const __m128 out0 = _mm_shuffle_ps(ab, _mm_shuffle_ps(c, a, _MM_SHUFFLE(1, 0, 1, 0)), _MM_SHUFFLE(3, 0, 1, 0));
+            const __m128 out1 = _mm_shuffle_ps(_mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 1, 1)),
+                                               _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 2, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0));
+            const __m128 out2 = _mm_shuffle_ps(_mm_shuffle_ps(c, a, _MM_SHUFFLE(3, 3, 2, 2)), _mm_unpackhi_ps(b, c),
+                                               _MM_SHUFFLE(3, 2, 2, 0));
+
+            storeWords<Layout>(words, _mm_castps_si128(out0));
+            storeWords<Layout>(words + 4 * wordStep, _mm_castps_si128(out1));
+            storeWords<Layout>(words + 8 * wordStep, _mm_castps_si128(out2));
+            words += 12 * wordStep;
+        }
+        return i;
+    }
+
+#elif defined(__ARM_NEON)
+
+    int swizzleVector(const ws2811_led_t *leds, int count, int colors, const uint8_t shuffleBytes[16], uint8_t *bytes)
+    {
+        int i = 0;
+
+#if defined(__aarch64__)
+        const uint8x16_t shuffle = vld1q_u8(shuffleBytes);
+
+        for (; i + 4 <= count; i += 4)
+        {
+            const uint8x16_t in = vld1q_u8((const uint8_t *)(leds + i));
+            vst1q_u8(bytes + i * colors, vqtbl1q_u8(in, shuffle));
+        }
+#else
+        const uint8x8_t shuffleLow = vld1_u8(shuffleBytes);
+        const uint8x8_t shuffleHigh = vld1_u8(shuffleBytes + 8);
+
+        for (; i + 4 <= count; i += 4)
+        {
+            const uint8x16_t in = vld1q_u8((const uint8_t *)(leds + i));
+            const uint8x8x2_t table = {{vget_low_u8(in), vget_high_u8(in)}};
+            vst1q_u8(bytes + i * colors, vcombine_u8(vtbl2_u8(table, shuffleLow), vtbl2_u8(table, shuffleHigh)));
+        }
+#endif
+        return i;
+    }
+
+    int scaleBytesVector(uint8_t *bytes, int count, int scale)
+    {
+        int i = 0;
+
+        for (; i + 16 <= count; i += 16)
+        {
+            const uint8x16_t in = vld1q_u8(bytes + i);
+            const uint16x8_t lo = vmulq_n_u16(vmovl_u8(vget_low_u8(in)), scale);
+            const uint16x8_t hi = vmulq_n_u16(vmovl_u8(vget_high_u8(in)), scale);
+            vst1q_u8(bytes + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+        }
+        return i;
+    }
+
+#if defined(__aarch64__)
+    // 64 bytes of a table, without vld1q_u8_x4 as the arm_neon.h of GCC before 9 lacks it
+    inline uint8x16x4_t loadTable64(const uint8_t *lut)
+    {
+        const uint8x16x4_t table = {{vld1q_u8(lut), vld1q_u8(lut + 16), vld1q_u8(lut + 32), vld1q_u8(lut + 48)}};
+
+        return table;
+    }
+#endif
+
+    int lookupBytesVector(uint8_t *bytes, int count, const uint8_t *lut)
+    {
+        int i = 0;
+
+#if defined(__aarch64__)
+        // the 256 entry table as four 64 byte tables, out of range indexes leave the result as is
+        const uint8x16x4_t table0 = loadTable64(lut);
+        const uint8x16x4_t table1 = loadTable64(lut + 64);
+        const uint8x16x4_t table2 = loadTable64(lut + 128);
+        const uint8x16x4_t table3 = loadTable64(lut + 192);
+        const uint8x16_t step = vdupq_n_u8(64);
+
+        for (; i + 16 <= count; i += 16)
+        {
+            uint8x16_t index = vld1q_u8(bytes + i);
+            uint8x16_t out = vqtbl4q_u8(table0, index);
+            index = vsubq_u8(index, step);
+            out = vqtbx4q_u8(out, table1, index);
+            index = vsubq_u8(index, step);
+            out = vqtbx4q_u8(out, table2, index);
+            index = vsubq_u8(index, step);
+            out = vqtbx4q_u8(out, table3, index);
+            vst1q_u8(bytes + i, out);
+        }
+#else
+        // no byte table lookup wider than 8 entries on 32-bit NEON
+        (void)bytes;
+        (void)count;
+        (void)lut;
+#endif
+        return i;
+    }
+
+    // Top bit of every byte lane, lane n in bit n, like _mm_movemask_epi8
+    inline uint16_t signMask(uint8x16_t v)
+    {
+        static const int8_t laneShift[16] = {0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7};
+        const uint8x16_t bits = vshlq_u8(vshrq_n_u8(v, 7), vld1q_s8(laneShift));
+        uint8x8_t sum = vpadd_u8(vget_low_u8(bits), vget_high_u8(bits));
+
+        sum = vpadd_u8(sum, sum);
+        sum = vpadd_u8(sum, sum);
+        return vget_lane_u16(vreinterpret_u16_u8(sum), 0);
+    }
+
+    /**
+     * Transposes 16 color bytes of each of the 16 rows at a time into bit-planes.
+     *
+     * @returns Number of bytes transposed per row, a multiple of 16.
+     */
+    int transposePlanesVector(const uint8_t *rows, int stride, int count, uint16_t *planes)
+    {
+        int i = 0;
+
+        for (; i + 16 <= count; i += 16)
+        {
+            uint8x16_t v[WS2811_PLANE_CHANNELS];
+
+            for (int row = 0; row < WS2811_PLANE_CHANNELS; row++)
+            {
+                v[row] = vld1q_u8(rows + row * stride + i);
+            }
+
+            // each round interleaves row r with row r + 8, which rotates the 8 bit row and
+            // column index left by one, so after 4 rounds vector j holds byte j of every row
+            for (int round = 0; round < 4; round++)
+            {
+                uint8x16_t t[WS2811_PLANE_CHANNELS];
+
+                for (int row = 0; row < 8; row++)
+                {
+                    const uint8x16x2_t zip = vzipq_u8(v[row], v[row + 8]);
+                    t[2 * row] = zip.val[0];
+                    t[2 * row + 1] = zip.val[1];
+                }
+                memcpy(v, t, sizeof(v));
+            }
+
+            // the byte sign bits of every row make one plane, MSB first
+            for (int byte = 0; byte < 16; byte++)
+            {
+                uint16_t *plane = planes + (i + byte) * 8;
+                uint8x16_t bits = v[byte];
+
+                for (int bit = 0; bit < 8; bit++)
+                {
+                    plane[bit] = signMask(bits);
+                    bits = vshlq_n_u8(bits, 1);
+                }
+            }
+        }
+        return i;
+    }
+
+    // One color byte per 32-bit lane into its 24 symbol bits, bit i of the byte is the middle
+    // bit of the symbol at bits 3i..3i+2
+    inline uint32x4_t spreadSymbols(uint32x4_t b)
+    {
+        b = vandq_u32(vorrq_u32(b, vshlq_n_u32(b, 8)), vdupq_n_u32(0x0000f00f));
+        b = vandq_u32(vorrq_u32(b, vshlq_n_u32(b, 4)), vdupq_n_u32(0x000c30c3));
+        b = vandq_u32(vorrq_u32(b, vshlq_n_u32(b, 2)), vdupq_n_u32(0x00249249));
+        return vorrq_u32(vshlq_n_u32(b, 1), vdupq_n_u32(WS2811_SYMBOL_FRAME));
+    }
+
+    /**
+     * Encodes 16 color bytes at a time into 12 whole words, starting at a word boundary.
+     *
+     * @returns Number of bytes encoded, a multiple of 16.
+     */
+    template <int Layout, bool Invert>
+    int encodeVector(const uint8_t *bytes, int count, uint32_t *words)
+    {
+        const int wordStep = Layout == WS2811_LAYOUT_PWM ? 2 : 1;
+        const uint32x4_t byteMask = vdupq_n_u32(0xff);
+        const uint32x4_t invertMask = vdupq_n_u32(Invert ? 0xffffffff : 0);
+        int i = 0;
+
+        for (; i + 16 <= count; i += 16)
+        {
+            // lane g holds bytes 4g..4g+3, which make up words 3g..3g+2
+            const uint32x4_t in = vreinterpretq_u32_u8(vld1q_u8(bytes + i));
+            const uint32x4_t s0 = spreadSymbols(vandq_u32(in, byteMask));
+            const uint32x4_t s1 = spreadSymbols(vandq_u32(vshrq_n_u32(in, 8), byteMask));
+            const uint32x4_t s2 = spreadSymbols(vandq_u32(vshrq_n_u32(in, 16), byteMask));
+            const uint32x4_t s3 = spreadSymbols(vshrq_n_u32(in, 24));
+            uint32x4x3_t out = {{
+                veorq_u32(vorrq_u32(vshlq_n_u32(s0, 8), vshrq_n_u32(s1, 16)), invertMask),
+                veorq_u32(vorrq_u32(vshlq_n_u32(s1, 16), vshrq_n_u32(s2, 8)), invertMask),
+                veorq_u32(vorrq_u32(vshlq_n_u32(s2, 24), s3), invertMask),
+            }};
+
+            if (Layout == WS2811_LAYOUT_SPI)
+            {
+                for (int k = 0; k < 3; k++)
+                {
+                    out.val[k] = vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(out.val[k])));
+                }
+            }
+
+            if (Layout == WS2811_LAYOUT_PWM)
+            {
+                // the odd words belong to the other channel, which may be encoded at the same time
+                uint32_t even[12];
+
+                vst3q_u32(even, out);
+                for (int k = 0; k < 12; k++)
+                {
+                    words[2 * k] = even[k];
+                }
+            }
+            else
+            {
+                vst3q_u32(words, out);
+            }
+            words += 12 * wordStep;
+        }
+        return i;
+    }
+
+#else
+
+    int swizzleVector(const ws2811_led_t *, int, int, const uint8_t[16], uint8_t *)
+    {
+        return 0;
+    }
+
+    int scaleBytesVector(uint8_t *, int, int)
+    {
+        return 0;
+    }
+
+    int lookupBytesVector(uint8_t *, int, const uint8_t *)
+    {
+        return 0;
+    }
+
+    int transposePlanesVector(const uint8_t *, int, int, uint16_t *)
+    {
+        return 0;
+    }
+
+    template <int Layout, bool Invert>
+    int encodeVector(const uint8_t *, int, uint32_t *)
+    {
+        return 0;
+    }
+
+#endif
+
+    template <int Layout, int SymbolBits>
+    inline void appendSymbol(uint64_t &bits, int &nbits, uint32_t *&words, uint32_t symbol)
+    {
+        bits = (bits << SymbolBits) | symbol;
+        nbits += SymbolBits;
+
+        if (nbits >= 32)
+        {
+            nbits -= 32;
+            storeWord<Layout>(words, (uint32_t)(bits >> nbits));
+            words += Layout == WS2811_LAYOUT_PWM ? 2 : 1;
+        }
+    }
+
+    /**
+     * One encoder is instantiated per layout and inversion so the inner loop carries no mode
+     * checks. Inverted symbols are the complement of the normal ones.
+     *
+     * The vector variant takes the symbol bits from WS2811_SYMBOL_FRAME instead of symbolLut
+     * once the output is word aligned again, the scalar variant is the reference for it. Only
+     * the scalar variant exists for 4 symbols per bit (SymbolBits 32), where every color byte
+     * is a whole word.
+     */
+    template <int Layout, bool Invert, bool Vector, int SymbolBits>
+    int encodeBytes(const uint8_t *bytes, int count, const uint32_t *symbolLut, uint32_t *words, int carryBits)
+    {
+        const uint32_t invertMask = Invert ? (uint32_t)(~0ULL >> (64 - SymbolBits)) : 0;
+        uint64_t bits = 0;
+        int nbits = 0;
+        int i = 0;
+
+        if (count == 0)
+        {
+            return carryBits;
+        }
+
+        // keep the leading bits of the first word that the previous channel already used
+        if (carryBits)
+        {
+            bits = loadWord<Layout>(words) >> (32 - carryBits);
+            nbits = carryBits;
+        }
+
+        if (Vector)
+        {
+            // 4 bytes fill exactly 3 words, so the output is aligned again after at most 3 bytes
+            for (; (i < count) && nbits; i++)
+            {
+                appendSymbol<Layout, SymbolBits>(bits, nbits, words, symbolLut[bytes[i]] ^ invertMask);
+            }
+
+            const int done = encodeVector<Layout, Invert>(bytes + i, count - i, words);
+            words += (done / 4) * 3 * (Layout == WS2811_LAYOUT_PWM ? 2 : 1);
+            i += done;
+        }
+
+        for (; i < count; i++)
+        {
+            appendSymbol<Layout, SymbolBits>(bits, nbits, words, symbolLut[bytes[i]] ^ invertMask);
+        }
+
+        // bits past the end of the data in the last word are left untouched
+        if (nbits)
+        {
+            const uint32_t mask = ~0U << (32 - nbits);
+            const uint32_t last = (uint32_t)(bits << (32 - nbits));
+
+            storeWord<Layout>(words, (loadWord<Layout>(words) & ~mask) | (last & mask));
+        }
+
+        return nbits;
+    }
+
+    template <int Layout, bool Vector, int SymbolBits>
+    struct LayoutEncoders
+    {
+        static constexpr ws2811_encoder_t byInvert[2] = {encodeBytes<Layout, false, Vector, SymbolBits>,
+                                                         encodeBytes<Layout, true, Vector, SymbolBits>};
+    };
+
+    template <int Layout, bool Vector, int SymbolBits>
+    constexpr ws2811_encoder_t LayoutEncoders<Layout, Vector, SymbolBits>::byInvert[2];
+
+    template <bool Vector, int SymbolBits>
+    ws2811_encoder_t selectEncoder(int layout, int invert)
+    {
+        const int invertIndex = invert ? 1 : 0;
+
+        switch (layout)
+        {
+        case WS2811_LAYOUT_PCM:
+            return LayoutEncoders<WS2811_LAYOUT_PCM, Vector, SymbolBits>::byInvert[invertIndex];
+        case WS2811_LAYOUT_SPI:
+            return LayoutEncoders<WS2811_LAYOUT_SPI, Vector, SymbolBits>::byInvert[invertIndex];
+        default:
+            return LayoutEncoders<WS2811_LAYOUT_PWM, Vector, SymbolBits>::byInvert[invertIndex];
+        }
+    }
+
+    // LEDs gathered through a channel's map at a time, small enough to stay in the L1 cache
+    constexpr int gatherLeds = 64;
+
+    void swizzleLeds(const ws2811_led_t *leds, int count, int colors, const uint8_t byteIndex[4],
+                     const uint8_t shuffle[16], uint8_t *bytes)
+    {
+        for (int i = swizzleVector(leds, count, colors, shuffle, bytes); i < count; i++)
+        {
+            const uint8_t *led = (const uint8_t *)&leds[i];
+
+            for (int color = 0; color < colors; color++)
+            {
+                bytes[i * colors + color] = led[byteIndex[color]];
+            }
+        }
+    }
+
+}
+
+/**
+ * Picks the encoder for a channel sending 3 symbols per bit with the symbols of
+ * WS2811_SYMBOL_FRAME.
+ *
+ * @param layout  One of the WS2811_LAYOUT_xxx constants.
+ * @param invert  Non-zero to send inverted symbols (software inversion for PCM and SPI).
+ */
+ws2811_encoder_t ws2811_encoder_select(int layout, int invert)
+{
+    return selectEncoder<true, 24>(layout, invert);
+}
+
+/**
+ * Same as ws2811_encoder_select, but for the encoder without vector instructions that only
+ * uses the symbol lookup table, so it works with any symbols.
+ *
+ * @param symbols  Symbols per bit, 3 or 4.
+ */
+ws2811_encoder_t ws2811_encoder_select_scalar(int layout, int invert, int symbols)
+{
+    return (symbols == 4) ? selectEncoder<false, 32>(layout, invert) : selectEncoder<false, 24>(layout, invert);
+}
+
+/**
+ * Number of colors per LED of a channel's strip type, 4 if the shift mask includes white.
+ */
+int ws2811_strip_colors(const ws2811_channel_t *channel)
+{
+    return (channel->strip_type & SK6812_SHIFT_WMASK) ? 4 : 3;
+}
+
+/**
+ * Turns LEDs of a channel into color bytes in strip order with the channel's color_lut
+ * applied, the input for the encoders. Whole groups of LEDs are handled with vector
+ * instructions where available. LEDs are read from the channel's source through its map
+ * if it has one.
+ *
+ * @param channel  Channel with the LEDs and an up to date color_lut.
+ * @param first    First LED to convert.
+ * @param count    Number of LEDs to convert.
+ * @param bytes    Output for count * colors bytes plus WS2811_PRESTAGE_SLACK.
+ */
+void ws2811_prestage(const ws2811_channel_t *channel, int first, int count, uint8_t *bytes)
+{
+    const int colors = ws2811_strip_colors(channel);
+    const int length = count * colors;
+    const int scale = (channel->brightness & 0xff) + 1;
+    uint8_t byteIndex[4];
+    uint8_t shuffle[16];
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    stripByteIndexes(channel, byteIndex);
+    buildShuffle(colors, byteIndex, shuffle);
+
+    if (channel->map)
+    {
+        // the LEDs are scattered over the caller's buffer, gather a few at a time for the
+        // vector swizzle instead of copying the whole frame into strip order first
+        ws2811_led_t gathered[gatherLeds];
+
+        for (int done = 0; done < count; done += gatherLeds)
+        {
+            const uint32_t *map = channel->map + first + done;
+            const int run = (count - done < gatherLeds) ? count - done : gatherLeds;
+
+            for (int i = 0; i < run; i++)
+            {
+                gathered[i] = channel->source[map[i]];
+            }
+            swizzleLeds(gathered, run, colors, byteIndex, shuffle, bytes + (done * colors));
+        }
+    }
+    else
+    {
+        swizzleLeds(channel->leds + first, count, colors, byteIndex, shuffle, bytes);
+    }
+
+    // With an uncorrected gamma table the color_lut is only the brightness scale, which is
+    // plain arithmetic. Otherwise fall back to the table itself. Checking the table is not
+    // worth it for a few LEDs.
+    if ((length >= 256) && isScale(channel->color_lut, scale))
+    {
+        if (scale != 256)
+        {
+            const int done = scaleBytesVector(bytes, length, scale);
+            scaleBytesScalar(bytes + done, length - done, scale);
+        }
+    }
+    else
+    {
+        const int done = lookupBytesVector(bytes, length, channel->color_lut);
+        lookupBytesScalar(bytes + done, length - done, channel->color_lut);
+    }
+}
+
+/**
+ * Turns the color bytes of up to WS2811_PLANE_CHANNELS channels into bit-planes, one mask of
+ * channels per bit on the wire, for driving all channels from the same GPIO writes.  Blocks of
+ * 16 bytes are transposed with vector instructions where available.
+ *
+ * @param rows    WS2811_PLANE_CHANNELS rows of color bytes in the order they are sent, channel c
+ *                at rows + c * stride.  Rows of unused channels are zero.
+ * @param stride  Bytes from one row to the next.
+ * @param count   Color bytes to transpose from each row.
+ * @param planes  Output for count * 8 masks, MSB of each byte first.  Bit c of a mask is set
+ *                if that bit of channel c is 1.
+ */
+void ws2811_transpose_planes(const uint8_t *rows, int stride, int count, uint16_t *planes)
+{
+    const int done = transposePlanesVector(rows, stride, count, planes);
+
+    ws2811_transpose_planes_scalar(rows + done, stride, count - done, planes + done * 8);
+}
+
+/**
+ * Reference version of ws2811_transpose_planes without any vector instructions.
+ */
+void ws2811_transpose_planes_scalar(const uint8_t *rows, int stride, int count, uint16_t *planes)
+{
+    for (int i = 0; i < count; i++)
+    {
+        for (int bit = 0; bit < 8; bit++)
+        {
+            uint16_t mask = 0;
+
+            for (int row = 0; row < WS2811_PLANE_CHANNELS; row++)
+            {
+                mask |= ((rows[row * stride + i] >> (7 - bit)) & 1) << row;
+            }
+            planes[i * 8 + bit] = mask;
+        }
+    }
+}
+
+/**
+ * Reference version of ws2811_prestage without any vector instructions.
+ */
+void ws2811_prestage_scalar(const ws2811_channel_t *channel, int first, int count, uint8_t *bytes)
+{
+    const int colors = ws2811_strip_colors(channel);
+    const uint8_t shifts[4] = {channel->rshift, channel->gshift, channel->bshift, channel->wshift};
+
+    for (int i = 0; i < count; i++)
+    {
+        const ws2811_led_t led = channel->map ? channel->source[channel->map[first + i]] : channel->leds[first + i];
+
+        for (int color = 0; color < colors; color++)
+        {
+            bytes[i * colors + color] = channel->color_lut[(led >> shifts[color]) & 0xff];
+        }
+    }
+}
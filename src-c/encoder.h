@@ -0,0 +1,55 @@
+#ifndef __ENCODER_H__
+#define __ENCODER_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include "ws2811.h"
+
+// Output buffer layouts, one per driver mode
+#define WS2811_LAYOUT_PWM 0 // 32-bit words, every other word belongs to the same channel
+#define WS2811_LAYOUT_PCM 1 // consecutive 32-bit words
+#define WS2811_LAYOUT_SPI 2 // consecutive bytes
+#define WS2811_LAYOUT_COUNT 3
+// Not encoded, frames of the parallel GPIO driver: a 32-bit mask of the GPIOs cleared early per bit
+#define WS2811_LAYOUT_GPIO 3
+
+// Symbol bits that are the same for every color bit, 0b100 per bit (see SYMBOL_HIGH/LOW)
+#define WS2811_SYMBOL_FRAME 0x924924
+
+// Extra bytes past the end of a prestage output buffer that vector stores may write to
+#define WS2811_PRESTAGE_SLACK 32
+
+// Channels that fit in one bit-plane mask
+#define WS2811_PLANE_CHANNELS 16
+
+    /**
+     * Encodes color bytes into symbol words.
+     *
+     * @param bytes      Color bytes in the order they are sent.
+     * @param count      Number of color bytes.
+     * @param symbolLut  256 entries with the symbol bits of each color byte, MSB first, 24 bits
+     *                   for 3 symbols per bit and 32 for 4.
+     * @param words      First word of the channel in the output buffer.
+     * @param carryBits  Bits of the first word already used by a previous channel.
+     * @returns Bits used in the last, partially filled word.
+     */
+    typedef int (*ws2811_encoder_t)(const uint8_t *bytes, int count, const uint32_t *symbolLut, uint32_t *words,
+                                    int carryBits);
+
+    ws2811_encoder_t ws2811_encoder_select(int layout, int invert);
+    ws2811_encoder_t ws2811_encoder_select_scalar(int layout, int invert, int symbols);
+    int ws2811_strip_colors(const ws2811_channel_t *channel);
+    void ws2811_prestage(const ws2811_channel_t *channel, int first, int count, uint8_t *bytes);
+    void ws2811_prestage_scalar(const ws2811_channel_t *channel, int first, int count, uint8_t *bytes);
+    void ws2811_transpose_planes(const uint8_t *rows, int stride, int count, uint16_t *planes);
+    void ws2811_transpose_planes_scalar(const uint8_t *rows, int stride, int count, uint16_t *planes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ENCODER_H__ */
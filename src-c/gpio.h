@@ -64,6 +64,7 @@ typedef struct
 
 
 #define GPIO_OFFSET                              (0x00200000)
+#define GPIO_PERIPH_PHYS                         (0x7e200000)
 
 
 static inline void gpio_function_set(volatile gpio_t *gpio, uint8_t pin, uint8_t function)
@@ -2,18 +2,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "matrix-control.h"
+#include "parallel.h"
 #include "ws2811.h"
 
 #define TARGET_FREQ WS2811_TARGET_FREQ
 #define GPIO_PIN 18
+#define GPIO_PIN_PWM1 13
+#define GPIO_PIN_SPI 10
 #define DMA 10
 #define STRIP_TYPE WS2811_STRIP_GBR
 
 ws2811_t ledInterface = {
     .freq = TARGET_FREQ,
     .dmanum = DMA,
+    .render_truncate = 1,
     .channel = {
         [0] = {
             .gpionum = GPIO_PIN,
@@ -27,10 +32,44 @@ ws2811_t ledInterface = {
             .count = 0,
             .invert = 0,
             .brightness = 0,
+            .strip_type = STRIP_TYPE,
+        },
+    },
+};
+
+// Second output for LED_OUTPUT_PWM_SPI, SPI does not use DMA so it can run next to ledInterface
+ws2811_t spiInterface = {
+    .freq = TARGET_FREQ,
+    .dmanum = DMA,
+    .render_truncate = 1,
+    .channel = {
+        [0] = {
+            .gpionum = GPIO_PIN_SPI,
+            .count = 0,
+            .invert = 0,
+            .brightness = 0,
+            .strip_type = STRIP_TYPE,
         },
     },
 };
 
+// Outputs of LED_OUTPUT_PARALLEL, every panel gets a channel of its own on the GPIOs in this order
+static const int parallelGpios[WS2811_PARALLEL_CHANNELS] = {
+    18, 13, 12, 19, 5, 6, 16, 17, 20, 21, 22, 23, 24, 25, 26, 27,
+};
+
+ws2811_parallel_t parallelInterface = {
+    .freq = TARGET_FREQ,
+    .dmanum = DMA,
+};
+
+int initOutputs = LED_OUTPUT_SINGLE;
+// The rest of what the driver was initialized with, for prepareStill to tell whether it can keep it
+int initTiming = WS2811_TIMING_DEFAULT;
+uint32_t initLedCount = 0;
+panel_t initPanel;
+uint32_t initPanelCount = 0;
+
 dimensions_t initDimensions = (dimensions_t){
     .width = 0,
     .height = 0,
@@ -38,35 +77,342 @@ dimensions_t initDimensions = (dimensions_t){
 
 bool initialized = false;
 
+// Hash of the frame last handed to the driver, to skip drawing it again
+bool lastFrameKnown = false;
+uint64_t lastFrameHash = 0;
+ws2811_fence_t lastFrameFence = 0;
+// Fences the drivers gave the last frame, which every output has its own of
+ws2811_fence_t lastPwmFence = 0;
+ws2811_fence_t lastSpiFence = 0;
+uint64_t skippedFrames = 0;
+
 dimensions_t getInitializedDimensions()
 {
     return initDimensions;
 }
 
+// The frame in row-major canvas order, which the driver reads through ledSource while encoding
+ws2811_led_t *canvas = NULL;
+
+// For every LED on the strip, the index of the canvas pixel it shows. Built once by ledInit and
+// used as the map of the LED channel.
+uint32_t *ledSource = NULL;
+
+// Fills source with the canvas pixel index of every LED of a panel
+static void buildLayout(const panel_t *panel, uint32_t canvasWidth, uint32_t *source)
+{
+    const dimensions_t dimensions = {.width = panel->width, .height = panel->height};
+    const int layout = panel->layout;
+    const int rotation = layout & LED_LAYOUT_ROTATE_MASK;
+    const bool turned = rotation == LED_LAYOUT_ROTATE_90 || rotation == LED_LAYOUT_ROTATE_270;
+    // the panel is taller than wide when the image is turned by 90 degrees to fit on it
+    const uint32_t panelWidth = turned ? dimensions.height : dimensions.width;
+    const uint32_t panelHeight = turned ? dimensions.width : dimensions.height;
+    const uint32_t count = dimensions.width * dimensions.height;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t x, y;
+        if (layout & LED_LAYOUT_COLUMNS)
+        {
+            x = i / panelHeight;
+            y = i % panelHeight;
+            if ((layout & LED_LAYOUT_SERPENTINE) && x % 2)
+            {
+                y = panelHeight - y - 1;
+            }
+        }
+        else
+        {
+            y = i / panelWidth;
+            x = i % panelWidth;
+            if ((layout & LED_LAYOUT_SERPENTINE) && y % 2)
+            {
+                x = panelWidth - x - 1;
+            }
+        }
+        if (layout & LED_LAYOUT_FLIP_X)
+        {
+            x = panelWidth - x - 1;
+        }
+        if (layout & LED_LAYOUT_FLIP_Y)
+        {
+            y = panelHeight - y - 1;
+        }
+
+        uint32_t imageX, imageY;
+        switch (rotation)
+        {
+        case LED_LAYOUT_ROTATE_90:
+            imageX = dimensions.width - y - 1;
+            imageY = x;
+            break;
+        case LED_LAYOUT_ROTATE_180:
+            imageX = dimensions.width - x - 1;
+            imageY = dimensions.height - y - 1;
+            break;
+        case LED_LAYOUT_ROTATE_270:
+            imageX = y;
+            imageY = dimensions.height - x - 1;
+            break;
+        default:
+            imageX = x;
+            imageY = y;
+            break;
+        }
+        source[i] = (panel->y + imageY) * canvasWidth + panel->x + imageX;
+    }
+}
+
 static void insertColors(ws2811_led_t *colors)
 {
-    for (uint32_t x = 0; x < initDimensions.width; x++)
+    if (colors != canvas)
+    {
+        memcpy(canvas, colors, sizeof(ws2811_led_t) * initDimensions.width * initDimensions.height);
+    }
+}
+
+static uint64_t mixHash(uint64_t hash, uint64_t value)
+{
+    hash ^= value * 0x9e3779b97f4a7c15ULL;
+    hash = (hash << 31) | (hash >> 33);
+    return hash * 0xc2b2ae3d27d4eb4fULL;
+}
+
+// 64-bit hash over everything that goes into the encoded frame: colors, brightness and gamma
+static uint64_t hashFrame(ws2811_led_t *colors)
+{
+    // every channel has the same brightness and gamma
+    const ws2811_channel_t *channel =
+        initOutputs == LED_OUTPUT_PARALLEL ? &parallelInterface.channel[0] : &ledInterface.channel[0];
+    const uint32_t count = initDimensions.width * initDimensions.height;
+    uint64_t hash = mixHash(0, channel->brightness);
+    uint64_t value;
+    uint32_t i;
+
+    for (i = 0; i + 2 <= count; i += 2)
+    {
+        memcpy(&value, &colors[i], sizeof(value));
+        hash = mixHash(hash, value);
+    }
+    if (i < count)
+    {
+        hash = mixHash(hash, colors[i]);
+    }
+
+    if (channel->gamma)
+    {
+        for (i = 0; i < 256; i += sizeof(value))
+        {
+            memcpy(&value, &channel->gamma[i], sizeof(value));
+            hash = mixHash(hash, value);
+        }
+    }
+
+    return hash ^ (hash >> 29);
+}
+
+// True if the frame is the one already drawn, which is then counted as skipped
+static bool isRepeatedFrame(ws2811_led_t *colors)
+{
+    const uint64_t hash = hashFrame(colors);
+
+    if (lastFrameKnown && hash == lastFrameHash)
+    {
+        skippedFrames++;
+        return true;
+    }
+
+    lastFrameHash = hash;
+    lastFrameKnown = true;
+    return false;
+}
+
+static bool renderFrame()
+{
+    bool rendered;
+    if (initOutputs == LED_OUTPUT_PARALLEL)
+    {
+        rendered = ws2811_parallel_render(&parallelInterface) == WS2811_SUCCESS;
+    }
+    else
     {
-        for (uint32_t y = 0; y < initDimensions.height; y++)
+        rendered = ws2811_render_async(&ledInterface, &lastPwmFence) == WS2811_SUCCESS;
+        if (initOutputs == LED_OUTPUT_PWM_SPI)
         {
-            uint32_t yIndex = x % 2 ? y : initDimensions.height - y - 1;
-            uint32_t xIndex = initDimensions.width - x - 1;
-            ledInterface.channel[0].leds[y + x * initDimensions.height] = colors[yIndex * initDimensions.width + xIndex];
+            rendered = ws2811_render_async(&spiInterface, &lastSpiFence) == WS2811_SUCCESS && rendered;
         }
     }
+    lastFrameFence++;
+
+    if (!rendered)
+    {
+        lastFrameKnown = false;
+        return false;
+    }
+    return true;
+}
+
+// LEDs in one row or column of a panel's strip
+static uint32_t panelLineLength(const panel_t *panel)
+{
+    const int rotation = panel->layout & LED_LAYOUT_ROTATE_MASK;
+    const bool turned = rotation == LED_LAYOUT_ROTATE_90 || rotation == LED_LAYOUT_ROTATE_270;
+
+    if (panel->layout & LED_LAYOUT_COLUMNS)
+    {
+        return turned ? panel->width : panel->height;
+    }
+    return turned ? panel->height : panel->width;
 }
 
-bool ledInit(dimensions_t dimensions, uint8_t brightness)
+// LEDs of the chain that go on the first of two outputs. The chain is cut at the end of a row or
+// column of a panel's strip, which includes the ends of the panels, where both parts are closest
+// in length. On ties the first part gets the longer one.
+static uint32_t splitChain(const panel_t *panels, uint32_t panelCount, uint32_t ledCount)
+{
+    uint32_t split = ledCount / 2;
+    uint32_t longest = ledCount;
+    uint32_t first = 0;
+    for (uint32_t i = 0; i < panelCount; i++)
+    {
+        const uint32_t lineLength = panelLineLength(&panels[i]);
+        const uint32_t panelEnd = first + panels[i].width * panels[i].height;
+        for (uint32_t cut = first + lineLength; cut <= panelEnd && cut < ledCount; cut += lineLength)
+        {
+            const uint32_t partLongest = cut > ledCount - cut ? cut : ledCount - cut;
+            if (partLongest <= longest)
+            {
+                split = cut;
+                longest = partLongest;
+            }
+        }
+        first = panelEnd;
+    }
+    return split;
+}
+
+// Checks that every panel lies on the canvas and counts their LEDs
+static bool countPanelLeds(dimensions_t dimensions, const panel_t *panels, uint32_t panelCount, uint32_t *count)
+{
+    *count = 0;
+    for (uint32_t i = 0; i < panelCount; i++)
+    {
+        const panel_t *panel = &panels[i];
+        if (!panel->width || !panel->height || panel->x + panel->width > dimensions.width ||
+            panel->y + panel->height > dimensions.height)
+        {
+            fprintf(stderr, "panel %u (%ux%u at %u,%u) does not fit on the %ux%u canvas\n", i, panel->width,
+                    panel->height, panel->x, panel->y, dimensions.width, dimensions.height);
+            return false;
+        }
+        *count += panel->width * panel->height;
+    }
+    return *count > 0;
+}
+
+// Puts every panel on a channel of its own for LED_OUTPUT_PARALLEL, all of them are sent at once
+static bool initParallel(const panel_t *panels, uint32_t panelCount, uint8_t brightness, int timing)
+{
+    parallelInterface.timing = timing;
+    for (uint32_t i = 0; i < WS2811_PARALLEL_CHANNELS; i++)
+    {
+        ws2811_channel_t *channel = &parallelInterface.channel[i];
+        channel->gpionum = parallelGpios[i];
+        channel->count = i < panelCount ? panels[i].width * panels[i].height : 0;
+        channel->invert = 0;
+        channel->brightness = brightness;
+        channel->strip_type = STRIP_TYPE;
+    }
+
+    ws2811_return_t initResult;
+    if ((initResult = ws2811_parallel_init(&parallelInterface)) != WS2811_SUCCESS)
+    {
+        fprintf(stderr, "ws2811_parallel_init failed: %s\n", ws2811_get_return_t_str(initResult));
+        return false;
+    }
+    for (uint32_t i = 0, first = 0; i < panelCount; i++)
+    {
+        parallelInterface.channel[i].map = ledSource + first;
+        parallelInterface.channel[i].source = canvas;
+        first += panels[i].width * panels[i].height;
+    }
+    return true;
+}
+
+bool ledInit(dimensions_t dimensions, uint8_t brightness, int timing, const panel_t *panels, uint32_t panelCount,
+             int outputs)
 {
     if (initialized)
     {
         return true;
     }
 
+    uint32_t ledCount;
+    if (!countPanelLeds(dimensions, panels, panelCount, &ledCount))
+    {
+        return false;
+    }
+    if (outputs != LED_OUTPUT_SINGLE && outputs != LED_OUTPUT_DUAL_PWM && outputs != LED_OUTPUT_PWM_SPI &&
+        outputs != LED_OUTPUT_PARALLEL)
+    {
+        fprintf(stderr, "unknown LED outputs %d\n", outputs);
+        return false;
+    }
+    if ((outputs == LED_OUTPUT_DUAL_PWM || outputs == LED_OUTPUT_PWM_SPI) && ledCount < 2)
+    {
+        fprintf(stderr, "a single LED cannot be split across two outputs\n");
+        return false;
+    }
+    if (outputs == LED_OUTPUT_PARALLEL && panelCount > WS2811_PARALLEL_CHANNELS)
+    {
+        fprintf(stderr, "%u panels do not fit on the %d parallel outputs\n", panelCount, WS2811_PARALLEL_CHANNELS);
+        return false;
+    }
+
     initDimensions = dimensions;
+    initOutputs = outputs;
+    initTiming = timing;
+    initLedCount = ledCount;
+    initPanel = panels[0];
+    initPanelCount = panelCount;
+    lastFrameKnown = false;
+
+    free(canvas);
+    free(ledSource);
+    canvas = calloc(dimensions.width * dimensions.height, sizeof(ws2811_led_t));
+    ledSource = malloc(sizeof(uint32_t) * ledCount);
+    if (!canvas || !ledSource)
+    {
+        fprintf(stderr, "failed to allocate the LED layout\n");
+        return false;
+    }
+    for (uint32_t i = 0, first = 0; i < panelCount; i++)
+    {
+        buildLayout(&panels[i], dimensions.width, ledSource + first);
+        first += panels[i].width * panels[i].height;
+    }
+
+    if (outputs == LED_OUTPUT_PARALLEL)
+    {
+        initialized = initParallel(panels, panelCount, brightness, timing);
+        return initialized;
+    }
+
+    const uint32_t firstCount = outputs == LED_OUTPUT_SINGLE ? ledCount : splitChain(panels, panelCount, ledCount);
+    ws2811_channel_t *second = outputs == LED_OUTPUT_DUAL_PWM ? &ledInterface.channel[1] : &spiInterface.channel[0];
 
     ledInterface.channel[0].brightness = brightness;
-    ledInterface.channel[0].count = dimensions.height * dimensions.width;
+    ledInterface.channel[0].count = firstCount;
+    ledInterface.channel[1].gpionum = outputs == LED_OUTPUT_DUAL_PWM ? GPIO_PIN_PWM1 : 0;
+    ledInterface.channel[1].count = 0;
+    ledInterface.timing = timing;
+    if (outputs != LED_OUTPUT_SINGLE)
+    {
+        second->brightness = brightness;
+        second->count = ledCount - firstCount;
+        spiInterface.timing = timing;
+    }
 
     ws2811_return_t initResult;
     if ((initResult = ws2811_init(&ledInterface)) != WS2811_SUCCESS)
@@ -74,49 +420,255 @@ bool ledInit(dimensions_t dimensions, uint8_t brightness)
         fprintf(stderr, "ws2811_init failed: %s\n", ws2811_get_return_t_str(initResult));
         return false;
     }
+    if (outputs == LED_OUTPUT_PWM_SPI && (initResult = ws2811_init(&spiInterface)) != WS2811_SUCCESS)
+    {
+        fprintf(stderr, "ws2811_init of SPI failed: %s\n", ws2811_get_return_t_str(initResult));
+        ws2811_fini(&ledInterface);
+        return false;
+    }
+    ledInterface.channel[0].map = ledSource;
+    ledInterface.channel[0].source = canvas;
+    if (outputs != LED_OUTPUT_SINGLE)
+    {
+        second->map = ledSource + firstCount;
+        second->source = canvas;
+    }
     initialized = true;
     return true;
 }
 
+ws2811_led_t *ledFrameBuffer()
+{
+    return initialized ? canvas : NULL;
+}
+
 bool ledDrawFrame(ws2811_led_t *colors)
 {
     if (initialized)
     {
+        if (isRepeatedFrame(colors))
+        {
+            return true;
+        }
         insertColors(colors);
-        ws2811_render(&ledInterface);
+        renderFrame();
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}
+
+bool ledSetBrightness(uint8_t brightness)
+{
+    if (initialized)
+    {
+        if (initOutputs == LED_OUTPUT_PARALLEL)
+        {
+            // the driver picks up the change with the next frame
+            for (uint32_t i = 0; i < WS2811_PARALLEL_CHANNELS; i++)
+            {
+                parallelInterface.channel[i].brightness = brightness;
+            }
+        }
+        else
+        {
+            ws2811_set_brightness(&ledInterface, 0, brightness);
+        }
+        if (initOutputs == LED_OUTPUT_DUAL_PWM)
+        {
+            ws2811_set_brightness(&ledInterface, 1, brightness);
+        }
+        else if (initOutputs == LED_OUTPUT_PWM_SPI)
+        {
+            ws2811_set_brightness(&spiInterface, 0, brightness);
+        }
+        // redraw the current frame so the change shows up right away, it is then the frame to skip
+        if (renderFrame())
+        {
+            lastFrameHash = hashFrame(canvas);
+            lastFrameKnown = true;
+        }
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}
+
+bool ledDrawFrameAsync(ws2811_led_t *colors, ws2811_fence_t *fence)
+{
+    if (initialized)
+    {
+        if (!isRepeatedFrame(colors))
+        {
+            insertColors(colors);
+            if (!renderFrame())
+            {
+                return false;
+            }
+        }
+        *fence = lastFrameFence;
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}
+
+bool ledPollFrame(ws2811_fence_t fence)
+{
+    if (initialized)
+    {
+        // only the last frame can still be on the wire
+        if (fence != lastFrameFence)
+        {
+            return true;
+        }
+        if (initOutputs == LED_OUTPUT_PARALLEL)
+        {
+            return ws2811_parallel_poll(&parallelInterface);
+        }
+        return ws2811_fence_poll(&ledInterface, lastPwmFence) &&
+               (initOutputs != LED_OUTPUT_PWM_SPI || ws2811_fence_poll(&spiInterface, lastSpiFence));
+    }
+    else
+    {
+        // nothing can be in flight without a driver
         return true;
     }
+}
+
+bool ledWaitFrame(ws2811_fence_t fence)
+{
+    if (initialized)
+    {
+        if (fence != lastFrameFence)
+        {
+            return true;
+        }
+        if (initOutputs == LED_OUTPUT_PARALLEL)
+        {
+            return ws2811_parallel_wait(&parallelInterface) == WS2811_SUCCESS;
+        }
+        bool waited = ws2811_fence_wait(&ledInterface, lastPwmFence) == WS2811_SUCCESS;
+        if (initOutputs == LED_OUTPUT_PWM_SPI)
+        {
+            waited = ws2811_fence_wait(&spiInterface, lastSpiFence) == WS2811_SUCCESS && waited;
+        }
+        return waited;
+    }
     else
     {
         return false;
     }
 }
 
+uint64_t ledSkippedFrameCount()
+{
+    return skippedFrames;
+}
+
 bool ledCleanUp()
 {
-    ws2811_fini(&ledInterface);
+    // the drivers have nothing to tear down unless they were initialized
+    if (initialized && initOutputs == LED_OUTPUT_PARALLEL)
+    {
+        ws2811_parallel_fini(&parallelInterface);
+    }
+    else if (initialized)
+    {
+        ws2811_fini(&ledInterface);
+        if (initOutputs == LED_OUTPUT_PWM_SPI)
+        {
+            ws2811_fini(&spiInterface);
+        }
+    }
     initialized = false;
+    lastFrameKnown = false;
+
+    ledInterface.channel[0].map = NULL;
+    ledInterface.channel[0].source = NULL;
+    ledInterface.channel[1].map = NULL;
+    ledInterface.channel[1].source = NULL;
+    spiInterface.channel[0].map = NULL;
+    spiInterface.channel[0].source = NULL;
+    for (uint32_t i = 0; i < WS2811_PARALLEL_CHANNELS; i++)
+    {
+        parallelInterface.channel[i].map = NULL;
+        parallelInterface.channel[i].source = NULL;
+    }
+    free(ledSource);
+    ledSource = NULL;
+    free(canvas);
+    canvas = NULL;
 
     return true;
 }
 
-bool drawStill(dimensions_t dimensions, uint8_t brightness, ws2811_led_t *colors)
+// Fits the live driver to a single panel of the given size, false if it has to be initialized
+// again. The device is kept for as many or fewer LEDs, only the canvas and its map are rebuilt.
+static bool reuseDriver(dimensions_t dimensions, const panel_t *panel)
 {
-    if (initialized)
+    const uint32_t ledCount = dimensions.width * dimensions.height;
+
+    if (initOutputs != LED_OUTPUT_SINGLE || initTiming != WS2811_TIMING_DEFAULT || ledCount > initLedCount)
     {
-        // start with a clean slate in case any of the init settings change
-        ledCleanUp();
+        return false;
+    }
+    if (initPanelCount == 1 && !memcmp(&initPanel, panel, sizeof(*panel)) &&
+        initDimensions.width == dimensions.width && initDimensions.height == dimensions.height)
+    {
+        return true;
     }
 
-    bool initSuccess = ledInit(dimensions, brightness);
-    if (!initSuccess)
+    // the driver only reads the canvas and the map while rendering, so both can change now
+    ws2811_led_t *resized = calloc(ledCount, sizeof(ws2811_led_t));
+    if (!resized || ws2811_set_count(&ledInterface, 0, ledCount) != WS2811_SUCCESS)
     {
+        free(resized);
         return false;
     }
-    bool drawSuccess = ledDrawFrame(colors);
-    if (!drawSuccess)
+    free(canvas);
+    canvas = resized;
+    buildLayout(panel, dimensions.width, ledSource);
+    ledInterface.channel[0].source = canvas;
+
+    initDimensions = dimensions;
+    initPanel = *panel;
+    initPanelCount = 1;
+    lastFrameKnown = false;
+    return true;
+}
+
+bool prepareStill(dimensions_t dimensions, uint8_t brightness)
+{
+    const panel_t panel = {
+        .x = 0,
+        .y = 0,
+        .width = dimensions.width,
+        .height = dimensions.height,
+        .layout = LED_LAYOUT_DEFAULT,
+    };
+
+    if (initialized && !reuseDriver(dimensions, &panel))
     {
-        return false;
+        // start with a clean slate as the init settings changed
+        ledCleanUp();
+    }
+
+    if (!initialized)
+    {
+        return ledInit(dimensions, brightness, WS2811_TIMING_DEFAULT, &panel, 1, LED_OUTPUT_SINGLE);
+    }
+    if (ledInterface.channel[0].brightness != brightness)
+    {
+        // the strip keeps the old brightness until the next frame, so that one can not be skipped
+        ws2811_set_brightness(&ledInterface, 0, brightness);
+        lastFrameKnown = false;
     }
     return true;
-}
\ No newline at end of file
+}
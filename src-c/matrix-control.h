@@ -16,10 +16,50 @@ extern "C"
         uint32_t height;
     } dimensions_t;
 
-    bool drawStill(dimensions_t dimensions, uint8_t brightness, ws2811_led_t *colors);
-    bool ledInit(dimensions_t dimensions, uint8_t brightness);
+// How the LED strip runs through the panel, or-ed together. The strip starts in the top left
+// corner of the panel and runs along its rows unless LED_LAYOUT_COLUMNS is given.
+#define LED_LAYOUT_ROWS 0                  // strip runs along the rows, one row after the other
+#define LED_LAYOUT_COLUMNS (1 << 0)        // strip runs along the columns instead
+#define LED_LAYOUT_SERPENTINE (1 << 1)     // every second row or column runs backwards
+#define LED_LAYOUT_FLIP_X (1 << 2)         // strip starts on the right side of the panel
+#define LED_LAYOUT_FLIP_Y (1 << 3)         // strip starts on the bottom of the panel
+#define LED_LAYOUT_ROTATE_90 (1 << 4)      // panel is mounted turned clockwise by 90 degrees
+#define LED_LAYOUT_ROTATE_180 (2 << 4)
+#define LED_LAYOUT_ROTATE_270 (3 << 4)
+#define LED_LAYOUT_ROTATE_MASK (3 << 4)
+#define LED_LAYOUT_DEFAULT (LED_LAYOUT_COLUMNS | LED_LAYOUT_SERPENTINE | LED_LAYOUT_FLIP_X | LED_LAYOUT_FLIP_Y)
+
+// Outputs the chain of panels is sent on. With two outputs the chain is cut at the end of a row or
+// column of a panel's strip where both parts are closest in length, so both take about the same
+// time to send. That can be inside a panel, whose strip then has to be cut there as well.
+// LED_OUTPUT_PARALLEL does not cut the chain but sends every panel at once on a GPIO of its own.
+#define LED_OUTPUT_SINGLE 0   // the whole chain on GPIO 18
+#define LED_OUTPUT_DUAL_PWM 1 // the first part on GPIO 18, the rest on GPIO 13
+#define LED_OUTPUT_PWM_SPI 2  // the first part on GPIO 18, the rest on GPIO 10 (SPI)
+#define LED_OUTPUT_PARALLEL 3 // up to 16 panels on GPIO 18, 13, 12, 19, 5, 6, 16, 17 and 20 to 27
+
+    // A panel chained on the data line, covering part of the canvas. Panels are chained in the order
+    // they are given in.
+    typedef struct
+    {
+        uint32_t x;      // left edge of the panel on the canvas
+        uint32_t y;      // top edge of the panel on the canvas
+        uint32_t width;  // pixels of the canvas the panel covers, after any rotation
+        uint32_t height;
+        int layout;      // LED_LAYOUT_xxx flags of the panel
+    } panel_t;
+
+    bool prepareStill(dimensions_t dimensions, uint8_t brightness);
+    bool ledInit(dimensions_t dimensions, uint8_t brightness, int timing, const panel_t *panels, uint32_t panelCount,
+                 int outputs);
     bool ledCleanUp();
+    ws2811_led_t *ledFrameBuffer();
     bool ledDrawFrame(ws2811_led_t *colors);
+    bool ledSetBrightness(uint8_t brightness);
+    bool ledDrawFrameAsync(ws2811_led_t *colors, ws2811_fence_t *fence);
+    bool ledPollFrame(ws2811_fence_t fence);
+    bool ledWaitFrame(ws2811_fence_t fence);
+    uint64_t ledSkippedFrameCount();
     dimensions_t getInitializedDimensions();
 
 #ifdef __cplusplus
@@ -0,0 +1,747 @@
+/*
+ * parallel.c
+ *
+ * Drives many strips at once from GPIO bit-planes.  The color bytes of all channels are
+ * transposed into one mask of channels per bit on the wire, and each bit becomes three GPIO
+ * writes made by DMA:
+ *
+ *     slot 0          set the pins of all channels
+ *     low high time   clear the pins of channels sending a 0
+ *     high high time  clear the pins of all channels
+ *
+ * Between the writes the DMA waits for the PWM FIFO, which the PWM drains one word per symbol
+ * slot, so the writes follow the symbol rate of the timing profile.  Each write and each wait is
+ * a DMA control block of its own, 6 of them or 192 bytes of mailbox memory per bit.
+ *
+ * With WS2811_SIMULATE set no hardware is touched, the clear masks of each frame go to the file
+ * it names in the WS2811_LAYOUT_GPIO layout.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "clk.h"
+#include "dma.h"
+#include "gpio.h"
+#include "mailbox.h"
+#include "periph.h"
+#include "pwm.h"
+#include "rpihw.h"
+
+#include "parallel.h"
+#include "encoder.h"
+
+
+#define SYMBOL_FREQ(timing)                      ((timing)->freq * (timing)->symbols)
+
+// The PWM runs at half the crystal frequency and takes a FIFO word every symbol slot
+#define PACE_CLOCK_DIV                           2
+
+// Symbol slots of low output before the first bit, enough to fill the PWM FIFO so the first
+// waits are as long as all others
+#define PACE_LEAD_SLOTS                          16
+
+// Control blocks per bit, a GPIO write and a wait for each of the three writes
+#define CB_PER_BIT                               6
+
+// Number of DMA buffers, the next frame is written to one while the other is being sent
+#define PXL_RAW_COUNT                            2
+
+// Mailbox memory the buffers may take, a part of the 64 MB the VideoCore gets by default
+#define MBOX_MAX_SIZE                            (16 * 1024 * 1024)
+
+// Words in front of the clear masks of a buffer
+#define WORD_ZERO                                0   // Source of the FIFO writes
+#define WORD_PINS                                1   // Pins of all channels
+#define WORD_CLEAR                               2   // First clear mask, one per bit
+
+typedef struct ws2811_parallel_device
+{
+    int simulated;                               // No hardware, frames only go to sim_fd
+    int sim_fd;                                  // File the frames of a simulated driver go to, -1 if none
+    videocore_mbox_t mbox;
+    volatile dma_t *dma;
+    volatile pwm_t *pwm;
+    volatile gpio_t *gpio;
+    volatile cm_clk_t *cm_clk;
+    volatile dma_cb_t *dma_cb[PXL_RAW_COUNT];    // First control block of each buffer
+    uint32_t dma_cb_addr[PXL_RAW_COUNT];
+    volatile uint32_t *words[PXL_RAW_COUNT];     // Zero word, pin mask and clear masks
+    uint32_t buf_len;                            // Bytes of mailbox memory per buffer
+    int pxl_next;                                // Index of the buffer for the next frame
+    ws2811_timing_t timing;                      // Timing profile in use, freq filled in
+    int low_slots;                               // Symbol slots a 0 bit is high
+    int high_slots;                              // Symbol slots a 1 bit is high
+    int max_color_bytes;                         // Color bytes of the channel with the most of them
+    int bits;                                    // Bits on the wire per frame and channel
+    uint32_t pins;                               // GPIO mask of all used channels
+    uint32_t pin_lut[2][256];                    // GPIO mask of each low and high byte of a plane
+    uint8_t *rows;                               // Prestaged color bytes, one row per channel
+    int row_len;
+    uint16_t *planes;                            // Channels with a 1 for each bit
+    int color_lut_brightness[WS2811_PARALLEL_CHANNELS];  // Brightness the color_lut was built for
+    const uint8_t *color_lut_gamma[WS2811_PARALLEL_CHANNELS];  // Gamma table the color_lut was built from
+    uint64_t wire_time_ns;                       // Time it takes to send one buffer
+    uint64_t dma_deadline_ns;                    // Expected end of the frame on the wire
+} ws2811_parallel_device_t;
+
+/**
+ * Number of leading symbols of a bit that are high, which have to be followed only by low ones.
+ *
+ * @param    symbol   Symbols of the bit, first one in the MSB.
+ * @param    symbols  Symbols per bit.
+ *
+ * @returns  Symbol slots the output is high, -1 if the symbols are not one high pulse.
+ */
+static int high_slots(uint8_t symbol, int symbols)
+{
+    int slots = 0;
+
+    while ((slots < symbols) && (symbol & (1 << (symbols - 1 - slots))))
+    {
+        slots++;
+    }
+
+    if (symbol & ((1 << (symbols - slots)) - 1))
+    {
+        return -1;
+    }
+
+    return slots;
+}
+
+/**
+ * Fill in a control block that writes one word to a GPIO register.
+ *
+ * @param    device  Device holding the mailbox memory.
+ * @param    cb      Control block to fill in.
+ * @param    word    Word to write.
+ * @param    reg     Offset of the register from the start of gpio_t.
+ *
+ * @returns  None
+ */
+static void gpio_write_cb(ws2811_parallel_device_t *device, volatile dma_cb_t *cb, volatile uint32_t *word,
+                          uint32_t reg)
+{
+    cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS | RPI_DMA_TI_WAIT_RESP;
+    cb->source_ad = addr_to_bus(&device->mbox, word);
+    cb->dest_ad = GPIO_PERIPH_PHYS + reg;
+    cb->txfr_len = sizeof(uint32_t);
+    cb->stride = 0;
+}
+
+/**
+ * Fill in a control block that waits for a number of symbol slots by writing as many words
+ * to the PWM FIFO.
+ *
+ * @param    device  Device holding the mailbox memory.
+ * @param    cb      Control block to fill in.
+ * @param    zero    Word to write, all of them come from the same one.
+ * @param    slots   Symbol slots to wait.
+ *
+ * @returns  None
+ */
+static void pace_cb(ws2811_parallel_device_t *device, volatile dma_cb_t *cb, volatile uint32_t *zero, int slots)
+{
+    cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |         // 32-bit transfers
+             RPI_DMA_TI_WAIT_RESP |              // wait for write complete
+             RPI_DMA_TI_DEST_DREQ |              // user peripheral flow control
+             RPI_DMA_TI_PERMAP(5);               // PWM peripheral
+    cb->source_ad = addr_to_bus(&device->mbox, zero);
+    cb->dest_ad = (uintptr_t)&((pwm_t *)PWM_PERIPH_PHYS)->fif1;
+    cb->txfr_len = slots * sizeof(uint32_t);
+    cb->stride = 0;
+}
+
+/**
+ * Build the control block chain of a buffer.  Only the clear masks change from frame to frame,
+ * the chain itself stays the same.
+ *
+ * @param    parallel  ws2811_parallel instance pointer.
+ * @param    index     Index of the buffer.
+ *
+ * @returns  None
+ */
+static void build_chain(ws2811_parallel_t *parallel, int index)
+{
+    ws2811_parallel_device_t *device = parallel->device;
+    const ws2811_timing_t *timing = &device->timing;
+    volatile dma_cb_t *cb = device->dma_cb[index];
+    volatile uint32_t *words = device->words[index];
+    const uint32_t set = offsetof(gpio_t, set);
+    const uint32_t clr = offsetof(gpio_t, clr);
+    const int waits[3] =
+    {
+        device->low_slots,
+        device->high_slots - device->low_slots,
+        timing->symbols - device->high_slots,
+    };
+    const uint64_t reset_slots = ((uint64_t)timing->reset_us * SYMBOL_FREQ(timing)) / 1000000;
+    int bit, i, count = 0;
+
+    words[WORD_ZERO] = 0;
+    words[WORD_PINS] = device->pins;
+
+    pace_cb(device, &cb[count++], &words[WORD_ZERO], PACE_LEAD_SLOTS);
+    for (bit = 0; bit < device->bits; bit++)
+    {
+        volatile uint32_t *writes[3] = {&words[WORD_PINS], &words[WORD_CLEAR + bit], &words[WORD_PINS]};
+
+        for (i = 0; i < 3; i++)
+        {
+            gpio_write_cb(device, &cb[count++], writes[i], i ? clr : set);
+            if (waits[i])
+            {
+                pace_cb(device, &cb[count++], &words[WORD_ZERO], waits[i]);
+            }
+        }
+        words[WORD_CLEAR + bit] = device->pins;
+    }
+    pace_cb(device, &cb[count++], &words[WORD_ZERO], reset_slots + 1);
+
+    for (i = 0; i < count; i++)
+    {
+        cb[i].nextconbk = (i + 1 < count) ? addr_to_bus(&device->mbox, &cb[i + 1]) : 0;
+    }
+}
+
+/**
+ * Free the buffers and mailbox memory of a ws2811_parallel instance.
+ *
+ * @param    parallel  ws2811_parallel instance pointer.
+ *
+ * @returns  None
+ */
+static void parallel_cleanup(ws2811_parallel_t *parallel)
+{
+    ws2811_parallel_device_t *device = parallel->device;
+    int chan;
+
+    for (chan = 0; chan < WS2811_PARALLEL_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &parallel->channel[chan];
+
+        // The gamma table is only taken over once the channel got its color_lut
+        if (channel->color_lut)
+        {
+            free(channel->gamma);
+            channel->gamma = NULL;
+        }
+        free(channel->color_lut);
+        channel->color_lut = NULL;
+        free(channel->leds);
+        channel->leds = NULL;
+    }
+
+    if (!device)
+    {
+        return;
+    }
+
+    if (device->dma)
+    {
+        unmapmem((void *)device->dma, sizeof(dma_t));
+    }
+    if (device->pwm)
+    {
+        unmapmem((void *)device->pwm, sizeof(pwm_t));
+    }
+    if (device->cm_clk)
+    {
+        unmapmem((void *)device->cm_clk, sizeof(cm_clk_t));
+    }
+    if (device->gpio)
+    {
+        unmapmem((void *)device->gpio, sizeof(gpio_t));
+    }
+
+    if (device->simulated)
+    {
+        free(device->mbox.virt_addr);
+        sim_close(device->sim_fd);
+    }
+    else
+    {
+        mbox_free(&device->mbox);
+    }
+
+    free(device->rows);
+    free(device->planes);
+    free(device);
+    parallel->device = NULL;
+}
+
+/**
+ * Set up the PWM to take one FIFO word per symbol slot.  Its output is not routed to any pin.
+ *
+ * @param    parallel  ws2811_parallel instance pointer.
+ *
+ * @returns  None
+ */
+static void setup_pwm(ws2811_parallel_t *parallel)
+{
+    ws2811_parallel_device_t *device = parallel->device;
+    const uint32_t pwm_freq = rpi_osc_freq(parallel->rpi_hw) / PACE_CLOCK_DIV;
+    const uint32_t symbol_freq = SYMBOL_FREQ(&device->timing);
+
+    pwm_stop(device->pwm, device->cm_clk);
+    clk_start(device->cm_clk, PACE_CLOCK_DIV);
+
+    // PWM clocks per word, rounded to the nearest symbol slot length
+    pwm_dma_setup(device->pwm, (pwm_freq + (symbol_freq / 2)) / symbol_freq, RPI_PWM_CTL_USEF1 | RPI_PWM_CTL_MODE1,
+                  RPI_PWM_CTL_PWEN1);
+}
+
+/**
+ * Rebuild the table that maps a color byte to its brightness scaled and gamma corrected value.
+ *
+ * @param    parallel  ws2811_parallel instance pointer.
+ * @param    chan      Channel to update.
+ *
+ * @returns  None
+ */
+static void update_color_lut(ws2811_parallel_t *parallel, int chan)
+{
+    ws2811_channel_t *channel = &parallel->channel[chan];
+    const int scale = (channel->brightness & 0xff) + 1;
+    int x;
+
+    for (x = 0; x < 256; x++)
+    {
+        channel->color_lut[x] = channel->gamma[(x * scale) >> 8];
+    }
+
+    parallel->device->color_lut_brightness[chan] = channel->brightness;
+    parallel->device->color_lut_gamma[chan] = channel->gamma;
+}
+
+/**
+ * Stand in for mbox_alloc when running without hardware.  The control blocks and masks go to
+ * ordinary memory and a file named by the WS2811_SIMULATE value is opened for the frames,
+ * except for "1" or an empty value.
+ *
+ * @param    parallel  ws2811_parallel instance pointer.
+ * @param    path      Value of WS2811_SIMULATE.
+ *
+ * @returns  0 on success, error code otherwise.
+ */
+static ws2811_return_t sim_init(ws2811_parallel_t *parallel, const char *path)
+{
+    ws2811_parallel_device_t *device = parallel->device;
+
+    device->mbox.virt_addr = calloc(1, device->mbox.size);
+    if (!device->mbox.virt_addr)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    if (*path && strcmp(path, "1"))
+    {
+        device->sim_fd = sim_open(path);
+        if (device->sim_fd < 0)
+        {
+            fprintf(stderr, "Cannot open %s for the simulated frames\n", path);
+            return WS2811_ERROR_GENERIC;
+        }
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * "Send" a frame of a simulated driver by writing its clear masks to its file, if it has one,
+ * behind a ws2811_sim_header_t tagged with the GPIO of the first channel.
+ *
+ * @param    parallel  ws2811_parallel instance pointer.
+ * @param    index     Index of the buffer to send.
+ *
+ * @returns  0 on success, error code otherwise.
+ */
+static ws2811_return_t sim_send(ws2811_parallel_t *parallel, int index)
+{
+    ws2811_parallel_device_t *device = parallel->device;
+    ws2811_sim_header_t header;
+    struct iovec iov[2];
+    int chan = 0;
+
+    if (device->sim_fd < 0)
+    {
+        return WS2811_SUCCESS;
+    }
+
+    while (!parallel->channel[chan].count)
+    {
+        chan++;
+    }
+
+    header.magic = WS2811_SIM_MAGIC;
+    header.layout = WS2811_LAYOUT_GPIO;
+    header.symbols = device->timing.symbols;
+    header.len = sizeof(uint32_t) * device->bits;
+    header.gpionum = parallel->channel[chan].gpionum;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)(device->words[index] + WORD_CLEAR);
+    iov[1].iov_len = header.len;
+    if (writev(device->sim_fd, iov, 2) != (ssize_t)(sizeof(header) + header.len))
+    {
+        return WS2811_ERROR_GENERIC;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Allocate and initialize memory, buffers, pages, PWM, DMA, and GPIO.
+ *
+ * With WS2811_SIMULATE set in the environment no hardware is touched.  The driver acts as on
+ * a Pi 3, builds every frame as usual and fakes the wire time.
+ *
+ * @param    parallel  ws2811_parallel instance pointer.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+ws2811_return_t ws2811_parallel_init(ws2811_parallel_t *parallel)
+{
+    ws2811_parallel_device_t *device;
+    const ws2811_timing_t *timing;
+    const char *simulate = getenv(WS2811_SIMULATE_ENV);
+    ws2811_return_t ret;
+    int chan, i;
+
+    parallel->rpi_hw = simulate ? &simulated_hw : rpi_hw_detect();
+    if (!parallel->rpi_hw)
+    {
+        return WS2811_ERROR_HW_NOT_SUPPORTED;
+    }
+
+    parallel->device = calloc(1, sizeof(*parallel->device));
+    if (!parallel->device)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    device = parallel->device;
+    device->simulated = (simulate != NULL);
+    device->sim_fd = -1;
+    device->mbox.handle = -1;
+
+    // Initialize all pointers to NULL.  Any non-NULL pointers will be freed on cleanup.
+    for (chan = 0; chan < WS2811_PARALLEL_CHANNELS; chan++)
+    {
+        parallel->channel[chan].leds = NULL;
+        parallel->channel[chan].color_lut = NULL;
+    }
+
+    // Any of the first 32 GPIOs as a plain output, polarity is fixed by the shared writes
+    for (chan = 0; chan < WS2811_PARALLEL_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &parallel->channel[chan];
+        uint32_t pin;
+
+        if (!channel->count)
+        {
+            continue;
+        }
+
+        if ((channel->gpionum <= 0) || (channel->gpionum >= 32) || channel->invert ||
+            (device->pins & (1U << channel->gpionum)))
+        {
+            parallel_cleanup(parallel);
+            return WS2811_ERROR_ILLEGAL_GPIO;
+        }
+        pin = 1U << channel->gpionum;
+        device->pins |= pin;
+
+        for (i = 0; i < 256; i++)
+        {
+            if (i & (1 << (chan % 8)))
+            {
+                device->pin_lut[chan / 8][i] |= pin;
+            }
+        }
+
+        if (!channel->strip_type)
+        {
+            channel->strip_type = WS2811_STRIP_RGB;
+        }
+        channel->wshift = (channel->strip_type >> 24) & 0xff;
+        channel->rshift = (channel->strip_type >> 16) & 0xff;
+        channel->gshift = (channel->strip_type >> 8)  & 0xff;
+        channel->bshift = (channel->strip_type >> 0)  & 0xff;
+
+        if (channel->count * ws2811_strip_colors(channel) > device->max_color_bytes)
+        {
+            device->max_color_bytes = channel->count * ws2811_strip_colors(channel);
+        }
+    }
+
+    if (!device->pins)
+    {
+        parallel_cleanup(parallel);
+        return WS2811_ERROR_ILLEGAL_GPIO;
+    }
+
+    timing = ws2811_get_timing(parallel->timing);
+    if (!timing)
+    {
+        parallel_cleanup(parallel);
+        return WS2811_ERROR_TIMING;
+    }
+    device->timing = *timing;
+    if (!device->timing.freq)
+    {
+        device->timing.freq = parallel->freq;
+    }
+
+    // Both bits have to be a single high pulse, the 0 bit the shorter one
+    device->low_slots = high_slots(device->timing.symbol_low, device->timing.symbols);
+    device->high_slots = high_slots(device->timing.symbol_high, device->timing.symbols);
+    if ((device->low_slots <= 0) || (device->high_slots <= device->low_slots))
+    {
+        parallel_cleanup(parallel);
+        return WS2811_ERROR_TIMING;
+    }
+
+    // Shorter channels send zeros to the end of the longest one, which no LED listens to
+    device->bits = device->max_color_bytes * 8;
+
+    // Each buffer holds its control blocks followed by the words they read, which is about
+    // 200 bytes per bit of the longest channel
+    const uint64_t buf_len = (sizeof(dma_cb_t) * (((uint64_t)device->bits * CB_PER_BIT) + 2)) +
+                             (sizeof(uint32_t) * (WORD_CLEAR + (uint64_t)device->bits));
+    if (buf_len * PXL_RAW_COUNT > MBOX_MAX_SIZE)
+    {
+        fprintf(stderr, "Parallel channels of up to %d color bytes need %llu bytes of mailbox memory, at most %d is available\n",
+                device->max_color_bytes, (unsigned long long)(buf_len * PXL_RAW_COUNT), MBOX_MAX_SIZE);
+        parallel_cleanup(parallel);
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    device->buf_len = (buf_len + sizeof(dma_cb_t) - 1) & ~(sizeof(dma_cb_t) - 1);
+    device->mbox.size = (device->buf_len * PXL_RAW_COUNT + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+
+    device->row_len = (device->max_color_bytes + WS2811_PRESTAGE_SLACK + 15) & ~15;
+    device->rows = calloc(WS2811_PARALLEL_CHANNELS, device->row_len);
+    device->planes = malloc(sizeof(uint16_t) * device->bits);
+    if (!device->rows || !device->planes)
+    {
+        parallel_cleanup(parallel);
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    for (chan = 0; chan < WS2811_PARALLEL_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &parallel->channel[chan];
+
+        if (!channel->count)
+        {
+            continue;
+        }
+
+        channel->color_lut = malloc(sizeof(uint8_t) * 256);
+        channel->leds = calloc(channel->count, sizeof(ws2811_led_t));
+        if (!channel->gamma)
+        {
+            channel->gamma = malloc(sizeof(uint8_t) * 256);
+            if (channel->gamma)
+            {
+                for (i = 0; i < 256; i++)
+                {
+                    channel->gamma[i] = i;
+                }
+            }
+        }
+        if (!channel->leds || !channel->color_lut || !channel->gamma)
+        {
+            parallel_cleanup(parallel);
+            return WS2811_ERROR_OUT_OF_MEMORY;
+        }
+        update_color_lut(parallel, chan);
+    }
+
+    device->wire_time_ns = (((uint64_t)PACE_LEAD_SLOTS + ((uint64_t)device->bits * device->timing.symbols)) *
+                            1000000000) / SYMBOL_FREQ(&device->timing) + (device->timing.reset_us * 1000);
+    parallel->render_wait_time = device->wire_time_ns / 1000;
+
+    // A simulated driver uses ordinary memory in place of the mailbox and sends nothing
+    ret = device->simulated ? sim_init(parallel, simulate) : mbox_alloc(&device->mbox, parallel->rpi_hw);
+    if (ret != WS2811_SUCCESS)
+    {
+        parallel_cleanup(parallel);
+        return ret;
+    }
+
+    for (i = 0; i < PXL_RAW_COUNT; i++)
+    {
+        uint8_t *buf = device->mbox.virt_addr + (device->buf_len * i);
+
+        device->dma_cb[i] = (dma_cb_t *)buf;
+        device->dma_cb_addr[i] = addr_to_bus(&device->mbox, buf);
+        device->words[i] = (uint32_t *)(buf + (sizeof(dma_cb_t) * ((device->bits * CB_PER_BIT) + 2)));
+        build_chain(parallel, i);
+    }
+    device->pxl_next = 0;
+
+    if (device->simulated)
+    {
+        return WS2811_SUCCESS;
+    }
+
+    // Map the physical registers into userspace
+    device->dma = mapmem(dmanum_to_offset(parallel->dmanum) + parallel->rpi_hw->periph_base, sizeof(dma_t),
+                         DEV_MEM);
+    device->pwm = mapmem(PWM_OFFSET + parallel->rpi_hw->periph_base, sizeof(pwm_t), DEV_MEM);
+    device->gpio = mapmem(GPIO_OFFSET + parallel->rpi_hw->periph_base, sizeof(gpio_t), DEV_MEM);
+    device->cm_clk = mapmem(CM_PWM_OFFSET + parallel->rpi_hw->periph_base, sizeof(cm_clk_t), DEV_MEM);
+    if (!dmanum_to_offset(parallel->dmanum) || !device->dma || !device->pwm || !device->gpio || !device->cm_clk)
+    {
+        parallel_cleanup(parallel);
+        return WS2811_ERROR_MAP_REGISTERS;
+    }
+
+    // Start out low, the DMA only ever sets and clears these pins
+    for (chan = 0; chan < WS2811_PARALLEL_CHANNELS; chan++)
+    {
+        if (parallel->channel[chan].count)
+        {
+            gpio_level_set(device->gpio, parallel->channel[chan].gpionum, 0);
+            gpio_output_set(device->gpio, parallel->channel[chan].gpionum, 1);
+        }
+    }
+
+    setup_pwm(parallel);
+    device->dma->cs = 0;
+    device->dma->txfr_len = 0;
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Shut down DMA, PWM, and cleanup memory.  The pins are left as low outputs.
+ *
+ * @param    parallel  ws2811_parallel instance pointer.
+ *
+ * @returns  None
+ */
+void ws2811_parallel_fini(ws2811_parallel_t *parallel)
+{
+    ws2811_parallel_wait(parallel);
+    if (!parallel->device->simulated)
+    {
+        pwm_stop(parallel->device->pwm, parallel->device->cm_clk);
+        parallel->device->gpio->clr[0] = parallel->device->pins;
+    }
+
+    parallel_cleanup(parallel);
+}
+
+/**
+ * Wait for any executing DMA operation to complete before returning.
+ *
+ * @param    parallel  ws2811_parallel instance pointer.
+ *
+ * @returns  0 on success, -1 on DMA competion error
+ */
+ws2811_return_t ws2811_parallel_wait(ws2811_parallel_t *parallel)
+{
+    if (parallel->device->simulated)  // Nothing is sent, the frame takes as long as it would
+    {
+        sleep_until(parallel->device->dma_deadline_ns);
+        return WS2811_SUCCESS;
+    }
+
+    return dma_wait(parallel->device->dma, parallel->device->dma_deadline_ns);
+}
+
+/**
+ * Check whether the last frame has been sent, without waiting for it.
+ *
+ * @param    parallel  ws2811_parallel instance pointer.
+ *
+ * @returns  1 once the frame has been sent or the DMA stopped on an error, 0 otherwise.
+ */
+int ws2811_parallel_poll(ws2811_parallel_t *parallel)
+{
+    volatile dma_t *dma = parallel->device->dma;
+
+    if (parallel->device->simulated)
+    {
+        return get_nanosecond_timestamp() >= parallel->device->dma_deadline_ns;
+    }
+
+    return !(dma->cs & RPI_DMA_CS_ACTIVE) || (dma->cs & RPI_DMA_CS_ERROR);
+}
+
+/**
+ * Send the LEDs of all channels.  The frame is prepared in the buffer that is not being sent,
+ * then waits for the previous frame to finish and starts this one without waiting for it.
+ *
+ * @param    parallel  ws2811_parallel instance pointer.
+ *
+ * @returns  0 on success, -1 on DMA competion error
+ */
+ws2811_return_t ws2811_parallel_render(ws2811_parallel_t *parallel)
+{
+    ws2811_parallel_device_t *device = parallel->device;
+    const int index = device->pxl_next;
+    volatile uint32_t *clear = device->words[index] + WORD_CLEAR;
+    const uint32_t pins = device->pins;
+    ws2811_return_t ret;
+    int chan, bit;
+
+    for (chan = 0; chan < WS2811_PARALLEL_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &parallel->channel[chan];
+        uint8_t *row = device->rows + (device->row_len * chan);
+        int len;
+
+        if (!channel->count)
+        {
+            continue;
+        }
+
+        if ((channel->brightness != device->color_lut_brightness[chan]) ||
+            (channel->gamma != device->color_lut_gamma[chan]))
+        {
+            update_color_lut(parallel, chan);
+        }
+
+        // The prestage may write into the slack, which has to read as zero bits again
+        len = channel->count * ws2811_strip_colors(channel);
+        ws2811_prestage(channel, 0, channel->count, row);
+        memset(row + len, 0, device->row_len - len);
+    }
+
+    ws2811_transpose_planes(device->rows, device->row_len, device->max_color_bytes, device->planes);
+
+    // A channel with a 1 keeps its pin high until the last clear of the bit
+    for (bit = 0; bit < device->bits; bit++)
+    {
+        const uint16_t plane = device->planes[bit];
+
+        clear[bit] = pins & ~(device->pin_lut[0][plane & 0xff] | device->pin_lut[1][plane >> 8]);
+    }
+
+    if ((ret = ws2811_parallel_wait(parallel)) != WS2811_SUCCESS)
+    {
+        return ret;
+    }
+
+    if (device->simulated)
+    {
+        ret = sim_send(parallel, index);
+    }
+    else
+    {
+        dma_start_chain(device->dma, device->dma_cb_addr[index]);
+    }
+
+    device->dma_deadline_ns = get_nanosecond_timestamp() + device->wire_time_ns;
+    device->pxl_next = (index + 1) % PXL_RAW_COUNT;
+
+    return ret;
+}
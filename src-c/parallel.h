@@ -0,0 +1,46 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "ws2811.h"
+
+
+// Channels driven at the same time, one bit of a bit-plane mask each
+#define WS2811_PARALLEL_CHANNELS                 16
+
+struct ws2811_parallel_device;
+
+/*
+ * Drives up to WS2811_PARALLEL_CHANNELS strips on plain GPIO outputs at once.  Every bit on
+ * the wire is turned into three writes to the GPIO set and clear registers that DMA makes for
+ * all channels together, so a frame takes as long as the longest channel instead of the sum
+ * of all of them.  The PWM block only paces the DMA and is not connected to a pin, so this
+ * cannot be used together with a ws2811_t in PWM mode.
+ */
+typedef struct ws2811_parallel_t
+{
+    uint64_t render_wait_time;                   //< time in µs it takes to send a frame
+    struct ws2811_parallel_device *device;       //< Private data for driver use
+    const rpi_hw_t *rpi_hw;                      //< RPI Hardware Information
+    uint32_t freq;                               //< Required output frequency
+    int dmanum;                                  //< DMA number _not_ already in use
+    int timing;                                  //< Wire timing profile -- one of WS2811_TIMING_xxx constants
+    ws2811_channel_t channel[WS2811_PARALLEL_CHANNELS];  //< gpionum 1 to 31, invert is not supported
+} ws2811_parallel_t;
+
+ws2811_return_t ws2811_parallel_init(ws2811_parallel_t *parallel);              //< Initialize buffers/hardware
+void ws2811_parallel_fini(ws2811_parallel_t *parallel);                         //< Tear it all down
+ws2811_return_t ws2811_parallel_render(ws2811_parallel_t *parallel);            //< Send LEDs of all channels off to hardware
+ws2811_return_t ws2811_parallel_wait(ws2811_parallel_t *parallel);              //< Wait for DMA completion
+int ws2811_parallel_poll(ws2811_parallel_t *parallel);                          //< Check for DMA completion without waiting
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PARALLEL_H__ */
@@ -0,0 +1,392 @@
+/*
+ * Helpers for the clocks, mailbox memory, PWM and DMA that the ws2811 driver and the parallel
+ * GPIO driver both set up the same way, and for the file their simulated frames go to.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <limits.h>
+
+#include "periph.h"
+
+// Board a simulated driver pretends to run on, it has all the PWM, PCM and SPI pins
+const rpi_hw_t simulated_hw =
+{
+    .type = RPI_HWVER_TYPE_PI2,
+    .hwver = 0xa02082,
+    .periph_base = 0x3f000000,
+    .videocore_base = 0xc0000000,
+    .desc = "Simulated Pi 3 Model B",
+};
+
+// File shared by the simulated drivers with the same WS2811_SIMULATE path, see sim_open
+static struct
+{
+    pthread_mutex_t lock;
+    char path[PATH_MAX];
+    int fd;
+    int users;
+} sim_file = {PTHREAD_MUTEX_INITIALIZER, "", -1, 0};
+
+/**
+ * Open the file of a simulated driver.  Drivers that run at the same time, like the outputs of
+ * a board split over PWM and SPI, share the file of the same path instead of each truncating
+ * it, their frames are appended in the order they are sent.
+ *
+ * @param    path  File for the frames.
+ *
+ * @returns  File descriptor, -1 on error.
+ */
+int sim_open(const char *path)
+{
+    int fd;
+
+    pthread_mutex_lock(&sim_file.lock);
+    if (sim_file.users && !strcmp(sim_file.path, path))
+    {
+        sim_file.users++;
+        pthread_mutex_unlock(&sim_file.lock);
+        return sim_file.fd;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if ((fd >= 0) && !sim_file.users)
+    {
+        strncpy(sim_file.path, path, sizeof(sim_file.path) - 1);
+        sim_file.fd = fd;
+        sim_file.users = 1;
+    }
+    pthread_mutex_unlock(&sim_file.lock);
+
+    return fd;
+}
+
+/**
+ * Close the file of a simulated driver once the last driver sharing it is done with it.
+ *
+ * @param    fd  File descriptor returned by sim_open, nothing happens for -1.
+ *
+ * @returns  None
+ */
+void sim_close(int fd)
+{
+    if (fd < 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&sim_file.lock);
+    if ((fd != sim_file.fd) || !--sim_file.users)
+    {
+        close(fd);
+    }
+    if (!sim_file.users)
+    {
+        sim_file.fd = -1;
+    }
+    pthread_mutex_unlock(&sim_file.lock);
+}
+
+/**
+ * Provides CLOCK_MONOTONIC timestamp in nanoseconds, the clock used for absolute sleeps.
+ *
+ * @returns  Current timestamp in nanoseconds or 0 on error.
+ */
+uint64_t get_nanosecond_timestamp(void)
+{
+    struct timespec t;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &t) != 0) {
+        return 0;
+    }
+
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/**
+ * Sleep until an absolute CLOCK_MONOTONIC deadline.  Returns right away if it has passed.
+ *
+ * @param    deadline_ns  Deadline in nanoseconds as returned by get_nanosecond_timestamp.
+ *
+ * @returns  None
+ */
+void sleep_until(uint64_t deadline_ns)
+{
+    struct timespec t;
+
+    t.tv_sec = deadline_ns / 1000000000;
+    t.tv_nsec = deadline_ns % 1000000000;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+        ;
+}
+
+/**
+ * Poll a register until the masked bits read back as cleared.
+ *
+ * @param    reg   Register to read.
+ * @param    mask  Bits that have to clear.
+ *
+ * @returns  0 once cleared, -1 if still set after DMA_POLL_COUNT reads.
+ */
+int wait_reg_clear(volatile uint32_t *reg, uint32_t mask)
+{
+    int i;
+
+    for (i = 0; i < DMA_POLL_COUNT; i++)
+    {
+        if (!(*reg & mask))
+        {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Frequency of the crystal oscillator the clock managers run from.
+ *
+ * @param    rpi_hw  Board the driver runs on.
+ *
+ * @returns  Frequency in Hz.
+ */
+uint32_t rpi_osc_freq(const rpi_hw_t *rpi_hw)
+{
+    return (rpi_hw->type == RPI_HWVER_TYPE_PI4) ? OSC_FREQ_PI4 : OSC_FREQ;
+}
+
+/**
+ * Allocate DMA memory from the VideoCore and map it into userspace.  Nothing is left allocated
+ * on failure.
+ *
+ * @param    mbox    Mailbox memory with its size set, handle is -1 unless it succeeds.
+ * @param    rpi_hw  Board the driver runs on.
+ *
+ * @returns  0 on success, error code otherwise.
+ */
+ws2811_return_t mbox_alloc(videocore_mbox_t *mbox, const rpi_hw_t *rpi_hw)
+{
+    mbox->handle = mbox_open();
+    if (mbox->handle == -1)
+    {
+        return WS2811_ERROR_MAILBOX_DEVICE;
+    }
+
+    mbox->mem_ref = mem_alloc(mbox->handle, mbox->size, PAGE_SIZE, rpi_hw->videocore_base == 0x40000000 ? 0xC : 0x4);
+    if (mbox->mem_ref == 0)
+    {
+        mbox_close(mbox->handle);
+        mbox->handle = -1;
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    mbox->bus_addr = mem_lock(mbox->handle, mbox->mem_ref);
+    if (mbox->bus_addr == (uint32_t) ~0UL)
+    {
+        mem_free(mbox->handle, mbox->mem_ref);
+        mbox_close(mbox->handle);
+        mbox->handle = -1;
+        return WS2811_ERROR_MEM_LOCK;
+    }
+
+    mbox->virt_addr = mapmem(BUS_TO_PHYS(mbox->bus_addr), mbox->size, DEV_MEM);
+    if (!mbox->virt_addr)
+    {
+        mem_unlock(mbox->handle, mbox->mem_ref);
+        mem_free(mbox->handle, mbox->mem_ref);
+        mbox_close(mbox->handle);
+        mbox->handle = -1;
+        return WS2811_ERROR_MMAP;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Unmap and release memory allocated with mbox_alloc.
+ *
+ * @param    mbox  Mailbox memory, nothing happens if its handle is -1.
+ *
+ * @returns  None
+ */
+void mbox_free(videocore_mbox_t *mbox)
+{
+    if (mbox->handle == -1)
+    {
+        return;
+    }
+
+    unmapmem(mbox->virt_addr, mbox->size);
+    mem_unlock(mbox->handle, mbox->mem_ref);
+    mem_free(mbox->handle, mbox->mem_ref);
+    mbox_close(mbox->handle);
+
+    mbox->virt_addr = NULL;
+    mbox->handle = -1;
+}
+
+/**
+ * Given a userspace address pointer, return the matching bus address used by DMA.
+ *     Note: The bus address is not the same as the CPU physical address.
+ *
+ * @param    mbox  Mailbox memory the address points into.
+ * @param    virt  Userspace virtual address pointer.
+ *
+ * @returns  Bus address for use by DMA.
+ */
+uint32_t addr_to_bus(const videocore_mbox_t *mbox, const volatile void *virt)
+{
+    uint32_t offset = (uint8_t *)virt - mbox->virt_addr;
+
+    return mbox->bus_addr + offset;
+}
+
+/**
+ * Start a clock from the crystal oscillator and wait for it to run.
+ *
+ * @param    cm_clk  Clock manager registers of the peripheral.
+ * @param    divi    Integer divisor of the oscillator frequency.
+ *
+ * @returns  None
+ */
+void clk_start(volatile cm_clk_t *cm_clk, uint32_t divi)
+{
+    cm_clk->div = CM_CLK_DIV_PASSWD | CM_CLK_DIV_DIVI(divi);
+    cm_clk->ctl = CM_CLK_CTL_PASSWD | CM_CLK_CTL_SRC_OSC;
+    cm_clk->ctl = CM_CLK_CTL_PASSWD | CM_CLK_CTL_SRC_OSC | CM_CLK_CTL_ENAB;
+    while (!(cm_clk->ctl & CM_CLK_CTL_BUSY))
+        ;
+}
+
+/**
+ * Kill a clock, if it was running, and wait for it to stop.
+ *
+ * @param    cm_clk  Clock manager registers of the peripheral.
+ *
+ * @returns  None
+ */
+void clk_stop(volatile cm_clk_t *cm_clk)
+{
+    cm_clk->ctl = CM_CLK_CTL_PASSWD | CM_CLK_CTL_KILL;
+    while (wait_reg_clear(&cm_clk->ctl, CM_CLK_CTL_BUSY))
+    {
+        usleep(10);
+    }
+}
+
+/**
+ * Set up PWM channel 1, and channel 2 if ctl says so, to be fed from the FIFO by DMA.  The
+ * delays stay, as the block is rumored to lock up without them and has no status to poll.
+ * Make sure to use a high enough priority to avoid any FIFO underruns, especially if the CPU
+ * is busy doing lots of memory accesses, or another DMA controller is busy.
+ *
+ * @param    pwm     PWM registers, with the clock already running.
+ * @param    range   PWM clocks per FIFO word.
+ * @param    ctl     Channel modes and polarity.
+ * @param    enable  Channels to enable once set up.
+ *
+ * @returns  None
+ */
+void pwm_dma_setup(volatile pwm_t *pwm, uint32_t range, uint32_t ctl, uint32_t enable)
+{
+    pwm->rng1 = range;
+    usleep(10);
+    pwm->ctl = RPI_PWM_CTL_CLRF1;
+    usleep(10);
+    pwm->dmac = RPI_PWM_DMAC_ENAB | RPI_PWM_DMAC_PANIC(7) | RPI_PWM_DMAC_DREQ(3);
+    usleep(10);
+    pwm->ctl = ctl;
+    usleep(10);
+    pwm->ctl |= enable;
+}
+
+/**
+ * Stop the PWM controller and its clock.
+ *
+ * @param    pwm     PWM registers.
+ * @param    cm_clk  Clock manager registers of the PWM.
+ *
+ * @returns  None
+ */
+void pwm_stop(volatile pwm_t *pwm, volatile cm_clk_t *cm_clk)
+{
+    // Turn off the PWM in case already running
+    pwm->ctl = 0;
+    usleep(10);
+
+    clk_stop(cm_clk);
+}
+
+/**
+ * Reset a DMA channel and start it on a chain of control blocks.  The status is read back
+ * instead of sleeping, with a delay only if it does not settle.
+ *
+ * @param    dma      DMA channel registers.
+ * @param    cb_addr  Bus address of the first control block.
+ *
+ * @returns  None
+ */
+void dma_start_chain(volatile dma_t *dma, uint32_t cb_addr)
+{
+    dma->cs = RPI_DMA_CS_RESET;
+    if (wait_reg_clear(&dma->cs, RPI_DMA_CS_ACTIVE))
+    {
+        usleep(10);
+    }
+
+    dma->cs = RPI_DMA_CS_INT | RPI_DMA_CS_END;
+    if (wait_reg_clear(&dma->cs, RPI_DMA_CS_INT | RPI_DMA_CS_END))
+    {
+        usleep(10);
+    }
+
+    dma->conblk_ad = cb_addr;
+    dma->debug = 7; // clear debug error flags
+    dma->cs = RPI_DMA_CS_WAIT_OUTSTANDING_WRITES |
+              RPI_DMA_CS_PANIC_PRIORITY(15) |
+              RPI_DMA_CS_PRIORITY(15) |
+              RPI_DMA_CS_ACTIVE;
+}
+
+/**
+ * Wait for a DMA channel to finish.  The wire time of the frame is known, so it sleeps through
+ * it and only polls for the tail.
+ *
+ * @param    dma          DMA channel registers.
+ * @param    deadline_ns  Expected end of the transfer, from get_nanosecond_timestamp.
+ *
+ * @returns  0 on success, WS2811_ERROR_DMA if the DMA stopped on an error.
+ */
+ws2811_return_t dma_wait(volatile dma_t *dma, uint64_t deadline_ns)
+{
+    int polls = 0;
+
+    if (dma->cs & RPI_DMA_CS_ACTIVE)
+    {
+        sleep_until(deadline_ns);
+    }
+
+    while ((dma->cs & RPI_DMA_CS_ACTIVE) &&
+           !(dma->cs & RPI_DMA_CS_ERROR))
+    {
+        if (++polls > DMA_POLL_COUNT)
+        {
+            usleep(10);
+        }
+    }
+
+    if (dma->cs & RPI_DMA_CS_ERROR)
+    {
+        fprintf(stderr, "DMA Error: %08x\n", dma->debug);
+        return WS2811_ERROR_DMA;
+    }
+
+    return WS2811_SUCCESS;
+}
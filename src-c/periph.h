@@ -0,0 +1,50 @@
+#ifndef __PERIPH_H__
+#define __PERIPH_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+
+#include "clk.h"
+#include "dma.h"
+#include "mailbox.h"
+#include "pwm.h"
+#include "rpihw.h"
+#include "ws2811.h"
+
+#define BUS_TO_PHYS(x)                           ((x)&~0xC0000000)
+
+#define OSC_FREQ                                 19200000   // crystal frequency
+#define OSC_FREQ_PI4                             54000000   // Pi 4 crystal frequency
+
+/* Register reads before a status poll falls back to sleeping. */
+#define DMA_POLL_COUNT                           1000
+
+    // Clock, mailbox memory, PWM and DMA helpers shared by the ws2811 and parallel drivers
+    uint64_t get_nanosecond_timestamp(void);
+    void sleep_until(uint64_t deadline_ns);
+    int wait_reg_clear(volatile uint32_t *reg, uint32_t mask);
+    uint32_t rpi_osc_freq(const rpi_hw_t *rpi_hw);
+    ws2811_return_t mbox_alloc(videocore_mbox_t *mbox, const rpi_hw_t *rpi_hw);
+    void mbox_free(videocore_mbox_t *mbox);
+    uint32_t addr_to_bus(const videocore_mbox_t *mbox, const volatile void *virt);
+    void clk_start(volatile cm_clk_t *cm_clk, uint32_t divi);
+    void clk_stop(volatile cm_clk_t *cm_clk);
+    void pwm_dma_setup(volatile pwm_t *pwm, uint32_t range, uint32_t ctl, uint32_t enable);
+    void pwm_stop(volatile pwm_t *pwm, volatile cm_clk_t *cm_clk);
+    void dma_start_chain(volatile dma_t *dma, uint32_t cb_addr);
+    ws2811_return_t dma_wait(volatile dma_t *dma, uint64_t deadline_ns);
+
+    // Stand-ins for the hardware when WS2811_SIMULATE is set
+    extern const rpi_hw_t simulated_hw;
+    int sim_open(const char *path);
+    void sim_close(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PERIPH_H__ */
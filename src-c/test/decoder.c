@@ -0,0 +1,196 @@
+/*
+ * Turns encoded pxl_raw buffers back into color bytes and LEDs, so the output of any encoder
+ * can be checked without LED hardware.  It only knows the buffer layouts, not the encoders.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "decoder.h"
+#include "../encoder.h"
+
+/**
+ * Bit of a channel's symbol stream, counting from the start of its first word.
+ *
+ * @returns  0 or 1, -1 past the end of the buffer.
+ */
+static int read_bit(const ws2811_decode_format_t *format, const void *raw, uint32_t len, uint32_t bit)
+{
+    const uint32_t word = bit / 32;
+    const int shift = 31 - (bit % 32);
+
+    switch (format->layout)
+    {
+    case WS2811_LAYOUT_SPI:
+        // bytes, MSB first
+        if (bit / 8 >= len)
+        {
+            return -1;
+        }
+        return (((const uint8_t *)raw)[bit / 8] >> (7 - (bit % 8))) & 1;
+
+    case WS2811_LAYOUT_PWM:
+        // every other word belongs to the same channel
+        if (((2 * word) + format->channel + 1) * sizeof(uint32_t) > len)
+        {
+            return -1;
+        }
+        return (((const uint32_t *)raw)[(2 * word) + format->channel] >> shift) & 1;
+
+    default:
+        if ((word + 1) * sizeof(uint32_t) > len)
+        {
+            return -1;
+        }
+        return (((const uint32_t *)raw)[word] >> shift) & 1;
+    }
+}
+
+/**
+ * Decodes the color bytes of one channel from a pxl_raw buffer.
+ *
+ * @param format  Layout and symbols of the channel.
+ * @param raw     The buffer as it would be sent.
+ * @param len     Size of the buffer in bytes.
+ * @param bytes   Output for the color bytes in the order they are sent.
+ * @param count   Number of color bytes to decode.
+ *
+ * @returns  0 on success, otherwise 1 + the index of the first byte with a symbol that is neither
+ *           a 0 nor a 1 bit or that is cut off by the end of the buffer.
+ */
+int ws2811_decode_bytes(const ws2811_decode_format_t *format, const void *raw, uint32_t len, uint8_t *bytes,
+                        int count)
+{
+    const uint8_t invertMask = format->invert ? (1 << format->symbols) - 1 : 0;
+    uint32_t bit = format->firstBit;
+    int i, b, s;
+
+    for (i = 0; i < count; i++)
+    {
+        uint8_t value = 0;
+
+        for (b = 0; b < 8; b++)
+        {
+            uint8_t symbol = 0;
+
+            for (s = 0; s < format->symbols; s++)
+            {
+                const int level = read_bit(format, raw, len, bit++);
+
+                if (level < 0)
+                {
+                    return i + 1;
+                }
+                symbol = (symbol << 1) | level;
+            }
+
+            symbol ^= invertMask;
+            if (symbol == format->symbolHigh)
+            {
+                value |= 0x80 >> b;
+            }
+            else if (symbol != format->symbolLow)
+            {
+                return i + 1;
+            }
+        }
+        bytes[i] = value;
+    }
+
+    return 0;
+}
+
+/**
+ * Checks that a channel keeps the line low over a range of its symbol stream, as it does for
+ * the reset time and wherever no LED is being sent.
+ *
+ * @param format  Layout of the channel.
+ * @param raw     The buffer as it would be sent.
+ * @param len     Size of the buffer in bytes.
+ * @param bit     First bit of the range, counting from the start of the channel's first word.
+ * @param end     Bit after the range, the rest of the buffer is checked if it is past the end.
+ *
+ * @returns  1 if every bit in the range is 0, 0 otherwise.
+ */
+int ws2811_decode_idle(const ws2811_decode_format_t *format, const void *raw, uint32_t len, uint32_t bit,
+                       uint32_t end)
+{
+    for (; bit < end; bit++)
+    {
+        const int level = read_bit(format, raw, len, bit);
+
+        if (level < 0)
+        {
+            break;
+        }
+        if (level)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Reads the color bytes of one channel out of a WS2811_LAYOUT_GPIO frame of the parallel
+ * driver.  It holds a mask of the pins cleared after the high time of a 0 bit for every bit, so
+ * a channel sends a 1 where its pin is not in the mask.
+ *
+ * @param raw      The clear masks as they would be sent.
+ * @param len      Size of the frame in bytes.
+ * @param gpionum  GPIO of the channel.
+ * @param bytes    Output for the color bytes.
+ * @param count    Number of color bytes to decode.
+ *
+ * @returns  0 on success, -1 if the frame ends early.
+ */
+int ws2811_decode_gpio(const void *raw, uint32_t len, int gpionum, uint8_t *bytes, int count)
+{
+    const uint8_t *masks = raw;
+    uint32_t mask;
+    int i, bit;
+
+    if (len < sizeof(mask) * 8 * count)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        bytes[i] = 0;
+        for (bit = 0; bit < 8; bit++)
+        {
+            memcpy(&mask, masks + (sizeof(mask) * ((i * 8) + bit)), sizeof(mask));
+            bytes[i] = (bytes[i] << 1) | !(mask & (1U << gpionum));
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Puts color bytes in strip order back into LEDs with the shifts of a channel.  The values are
+ * the ones after the color_lut, so they only match the LEDs of the channel at full brightness
+ * and without gamma correction.
+ *
+ * @param channel  Channel with the shifts of its strip type.
+ * @param bytes    Color bytes as returned by ws2811_decode_bytes.
+ * @param count    Number of LEDs.
+ * @param leds     Output for the LEDs.
+ */
+void ws2811_decode_leds(const ws2811_channel_t *channel, const uint8_t *bytes, int count, ws2811_led_t *leds)
+{
+    const int colors = ws2811_strip_colors(channel);
+    const uint8_t shifts[4] = {channel->rshift, channel->gshift, channel->bshift, channel->wshift};
+    int i, color;
+
+    for (i = 0; i < count; i++)
+    {
+        leds[i] = 0;
+        for (color = 0; color < colors; color++)
+        {
+            leds[i] |= (ws2811_led_t)bytes[(i * colors) + color] << shifts[color];
+        }
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef __DECODER_H__
+#define __DECODER_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include "../ws2811.h"
+
+    // Where the bits of one channel are in a pxl_raw buffer and what its symbols look like
+    typedef struct
+    {
+        int layout;          // One of the WS2811_LAYOUT_xxx constants
+        int channel;         // Channel whose words to read from a WS2811_LAYOUT_PWM buffer
+        int firstBit;        // Bits of the channel's first word used by a previous channel
+        int symbols;         // Symbols per bit, 3 or 4
+        uint8_t symbolHigh;  // Symbols of a 1 bit, first one in the MSB
+        uint8_t symbolLow;   // Symbols of a 0 bit, first one in the MSB
+        int invert;          // Non-zero if the symbols were sent inverted
+    } ws2811_decode_format_t;
+
+    int ws2811_decode_bytes(const ws2811_decode_format_t *format, const void *raw, uint32_t len, uint8_t *bytes,
+                            int count);
+    int ws2811_decode_idle(const ws2811_decode_format_t *format, const void *raw, uint32_t len, uint32_t bit,
+                           uint32_t end);
+    int ws2811_decode_gpio(const void *raw, uint32_t len, int gpionum, uint8_t *bytes, int count);
+    void ws2811_decode_leds(const ws2811_channel_t *channel, const uint8_t *bytes, int count, ws2811_led_t *leds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DECODER_H__ */
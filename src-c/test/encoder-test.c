@@ -0,0 +1,1080 @@
+/*
+ * Checks that the encoding paths are bit-exact.  Random and adversarial frames go through every
+ * encoder variant and the per-bit loop of the first release, frozen here as the reference, the
+ * outputs are compared byte for byte and decoded back into the color bytes they were made from.
+ * The last part renders frames with simulated drivers, compared with the frozen loop as well,
+ * which covers dirty tracking, on multi-core machines the split over worker threads, and the
+ * parallel GPIO driver.  Runs without LED hardware.
+ *
+ * Build and run with: npm run test:encoder [iterations]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../ws2811.h"
+#include "../encoder.h"
+#include "../matrix-control.h"
+#include "../parallel.h"
+#include "decoder.h"
+
+#define MAX_BYTES       2048
+#define PATTERN_COUNT   8
+#define SHARED_FRAMES   8
+#define SHARED_LEDS     100
+#define PARALLEL_FRAMES 8
+#define PARALLEL_LEDS   120
+
+static const int strip_types[] =
+{
+    WS2811_STRIP_RGB, WS2811_STRIP_RBG, WS2811_STRIP_GRB, WS2811_STRIP_GBR, WS2811_STRIP_BRG, WS2811_STRIP_BGR,
+    SK6812_STRIP_RGBW, SK6812_STRIP_RBGW, SK6812_STRIP_GRBW, SK6812_STRIP_GBRW, SK6812_STRIP_BRGW, SK6812_STRIP_BGRW,
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static int failures;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 32);
+}
+
+static void fail(const char *what, const char *names, int a, int b, int c, int d)
+{
+    if (failures++ < 20)
+    {
+        printf("FAIL %s (%s %d %d %d %d)\n", what, names, a, b, c, d);
+    }
+}
+
+/**
+ * Fill bytes with one of the adversarial patterns, or random bytes for the last one.
+ */
+static void fill_pattern(uint8_t *bytes, int count, int pattern)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        switch (pattern)
+        {
+        case 0: bytes[i] = 0x00; break;
+        case 1: bytes[i] = 0xff; break;
+        case 2: bytes[i] = 0xaa; break;
+        case 3: bytes[i] = 0x55; break;
+        case 4: bytes[i] = 1 << (i % 8); break;           // walking one
+        case 5: bytes[i] = ~(1 << (i % 8)); break;        // walking zero
+        case 6: bytes[i] = i; break;
+        default: bytes[i] = rng(); break;
+        }
+    }
+}
+
+static void symbol_lut_init(uint32_t *lut, const ws2811_timing_t *timing)
+{
+    int value, k;
+
+    for (value = 0; value < 256; value++)
+    {
+        lut[value] = 0;
+        for (k = 7; k >= 0; k--)
+        {
+            lut[value] = (lut[value] << timing->symbols) |
+                         ((value & (1 << k)) ? timing->symbol_high : timing->symbol_low);
+        }
+    }
+}
+
+/**
+ * Position of the next symbol bit in a buffer, kept like the loop of the first release did.
+ */
+typedef struct
+{
+    int wordpos;    // PWM & PCM
+    int bytepos;    // SPI
+    int bitpos;
+} frozen_pos_t;
+
+/**
+ * The per-bit loop of ws2811_render as of the first release, frozen as the golden reference
+ * of the buffer layout: symbols MSB first, every other word of PWM for a channel, bytes for
+ * SPI.  It only differs in taking the symbols from the timing, as the release knew only the
+ * 3 symbol ones, in inverting whenever invert is set, as the encoders do, and in leaving the
+ * line low for color bytes that are not sent (NULL color).  Only the bits of the symbols are
+ * changed, everything else in the buffer stays as it is.
+ */
+static void frozen_encode(const uint8_t *color, int count, int layout, int invert, const ws2811_timing_t *timing,
+                          uint8_t *pxl_raw, frozen_pos_t *pos)
+{
+    int j, k, l;
+
+    for (j = 0; j < count; j++)                            // Color
+    {
+        for (k = 7; k >= 0; k--)                           // Bit
+        {
+            uint8_t symbol = 0;
+            if (color)
+            {
+                symbol = (color[j] & (1 << k)) ? timing->symbol_high : timing->symbol_low;
+                if (invert) symbol ^= (1 << timing->symbols) - 1;
+            }
+
+            for (l = timing->symbols - 1; l >= 0; l--)     // Symbol
+            {
+                uint32_t *wordptr = &((uint32_t *)pxl_raw)[pos->wordpos];   // PWM & PCM
+                uint8_t *byteptr = &pxl_raw[pos->bytepos];                  // SPI
+
+                if (layout == WS2811_LAYOUT_SPI)
+                {
+                    *byteptr &= ~(1 << pos->bitpos);
+                    if (symbol & (1 << l))
+                    {
+                        *byteptr |= (1 << pos->bitpos);
+                    }
+                }
+                else  // PWM & PCM
+                {
+                    *wordptr &= ~(1u << pos->bitpos);
+                    if (symbol & (1 << l))
+                    {
+                        *wordptr |= (1u << pos->bitpos);
+                    }
+                }
+
+                pos->bitpos--;
+                if (pos->bitpos < 0)
+                {
+                    if (layout == WS2811_LAYOUT_SPI)
+                    {
+                        pos->bytepos++;
+                        pos->bitpos = 7;
+                    }
+                    else  // PWM & PCM
+                    {
+                        // Every other word is on the same channel for PWM
+                        pos->wordpos += (layout == WS2811_LAYOUT_PWM ? 2 : 1);
+                        pos->bitpos = 31;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * A whole frame the way ws2811_render of the first release laid it out, with the colors
+ * through brightness and gamma as it applied them.  A channel goes on from the bit the one
+ * before ended on, in the next word of its own with PWM.  The LEDs of a channel from sent[chan]
+ * on are left low, as in a truncated frame.  Since then a single PWM channel takes consecutive
+ * words, so the layout is the one of the frame and pwm tells whether the driver uses PWM.
+ */
+static void frozen_render(const ws2811_channel_t *channels, ws2811_led_t *const *leds, const int *counts,
+                          const int *sent, int pwm, int layout, const ws2811_timing_t *timing, uint8_t *pxl_raw)
+{
+    frozen_pos_t pos = {0, 0, (layout == WS2811_LAYOUT_SPI) ? 7 : 31};
+    int i, chan;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)        // Channel
+    {
+        const ws2811_channel_t *channel = &channels[chan];
+        const int scale = (channel->brightness & 0xff) + 1;
+        const int array_size = ws2811_strip_colors(channel);
+
+        pos.wordpos = (layout == WS2811_LAYOUT_PWM) ? chan : 0;
+        pos.bytepos = 0;
+        for (i = 0; i < counts[chan]; i++)                 // Led
+        {
+            uint8_t color[] =
+            {
+                channel->gamma[(((leds[chan][i] >> channel->rshift) & 0xff) * scale) >> 8], // red
+                channel->gamma[(((leds[chan][i] >> channel->gshift) & 0xff) * scale) >> 8], // green
+                channel->gamma[(((leds[chan][i] >> channel->bshift) & 0xff) * scale) >> 8], // blue
+                channel->gamma[(((leds[chan][i] >> channel->wshift) & 0xff) * scale) >> 8], // white
+            };
+
+            // Inversion is handled by hardware for PWM, otherwise by software here
+            frozen_encode((i < sent[chan]) ? color : NULL, array_size, layout,
+                          !pwm && channel->invert, timing, pxl_raw, &pos);
+        }
+    }
+}
+
+/**
+ * One encoder against the frozen reference on the same input and the same dirty output buffer,
+ * then the reference output decoded back into the input.
+ */
+static void check_encoder(ws2811_encoder_t encoder, const ws2811_timing_t *timing, int layout, int invert,
+                          const uint8_t *bytes, int count)
+{
+    static uint32_t expected[MAX_BYTES * 4 + 16], actual[MAX_BYTES * 4 + 16];
+    static uint8_t decoded[MAX_BYTES];
+    const int carry = (layout == WS2811_LAYOUT_SPI) ? 0 : rng() % 32;
+    const int channel = (layout == WS2811_LAYOUT_PWM) ? rng() % 2 : 0;
+    frozen_pos_t pos = {channel, 0, (layout == WS2811_LAYOUT_SPI) ? 7 : 31 - carry};
+    uint32_t symbol_lut[256];
+    ws2811_decode_format_t format;
+    int i;
+
+    symbol_lut_init(symbol_lut, timing);
+    for (i = 0; i < (int)(sizeof(expected) / sizeof(expected[0])); i++)
+    {
+        expected[i] = actual[i] = rng();
+    }
+
+    frozen_encode(bytes, count, layout, invert, timing, (uint8_t *)expected, &pos);
+    const int expected_bits = (carry + (count * 8 * timing->symbols)) % 32;
+    const int actual_bits = encoder(bytes, count, symbol_lut, actual + channel, carry);
+    if ((expected_bits != actual_bits) || memcmp(expected, actual, sizeof(expected)))
+    {
+        fail("encoder differs from reference", "layout invert count carry", layout, invert, count, carry);
+        return;
+    }
+
+    format.layout = layout;
+    format.channel = channel;
+    format.firstBit = carry;
+    format.symbols = timing->symbols;
+    format.symbolHigh = timing->symbol_high;
+    format.symbolLow = timing->symbol_low;
+    format.invert = invert;
+    if (ws2811_decode_bytes(&format, expected, sizeof(expected), decoded, count) ||
+        memcmp(bytes, decoded, count))
+    {
+        fail("reference does not decode to its input", "layout invert count carry", layout, invert, count, carry);
+    }
+}
+
+static void test_encoders(int iterations)
+{
+    static uint8_t bytes[MAX_BYTES + WS2811_PRESTAGE_SLACK];
+    const ws2811_timing_t *timing3 = ws2811_get_timing(WS2811_TIMING_WS2812B);
+    const ws2811_timing_t *timing4 = ws2811_get_timing(WS2811_TIMING_SK6812);
+    int i, layout, invert;
+
+    for (i = 0; i < iterations; i++)
+    {
+        // short counts around the vector block sizes, then anything up to MAX_BYTES
+        const int count = (i % 2) ? rng() % 70 : rng() % MAX_BYTES;
+
+        fill_pattern(bytes, count, i % PATTERN_COUNT);
+        for (layout = 0; layout < WS2811_LAYOUT_COUNT; layout++)
+        {
+            for (invert = 0; invert < 2; invert++)
+            {
+                check_encoder(ws2811_encoder_select(layout, invert), timing3, layout, invert, bytes, count);
+                check_encoder(ws2811_encoder_select_scalar(layout, invert, 3), timing3, layout, invert, bytes,
+                              count);
+                check_encoder(ws2811_encoder_select_scalar(layout, invert, 4), timing4, layout, invert, bytes,
+                              count);
+            }
+        }
+    }
+}
+
+static void test_prestage(int iterations)
+{
+    static ws2811_led_t leds[MAX_BYTES];
+    static uint32_t map[MAX_BYTES];
+    static uint8_t expected[MAX_BYTES * 4 + WS2811_PRESTAGE_SLACK], actual[MAX_BYTES * 4 + WS2811_PRESTAGE_SLACK];
+    uint8_t gamma[256], color_lut[256];
+    ws2811_channel_t channel;
+    int i, x;
+
+    for (i = 0; i < iterations; i++)
+    {
+        const int count = (i % 2) ? rng() % 40 : rng() % MAX_BYTES;
+        const int first = count ? rng() % (count + 1) : 0;
+        const int scale = ((i % 3) ? (int)(rng() % 256) : (i % 2) * 255) % 256 + 1;
+
+        memset(&channel, 0, sizeof(channel));
+        channel.strip_type = strip_types[i % (sizeof(strip_types) / sizeof(strip_types[0]))];
+        channel.wshift = (channel.strip_type >> 24) & 0xff;
+        channel.rshift = (channel.strip_type >> 16) & 0xff;
+        channel.gshift = (channel.strip_type >> 8) & 0xff;
+        channel.bshift = (channel.strip_type >> 0) & 0xff;
+        channel.brightness = scale - 1;
+        channel.leds = leds;
+        channel.gamma = gamma;
+        channel.color_lut = color_lut;
+
+        // an uncorrected gamma table takes the arithmetic path, any other one the table lookup
+        for (x = 0; x < 256; x++)
+        {
+            gamma[x] = (i % 4) ? x : (int)(rng() & 0xff);
+        }
+        for (x = 0; x < 256; x++)
+        {
+            color_lut[x] = gamma[(x * scale) >> 8];
+        }
+
+        fill_pattern((uint8_t *)leds, count * sizeof(ws2811_led_t), i % PATTERN_COUNT);
+
+        // every fifth frame reads the LEDs shuffled through a map
+        if ((i % 5) == 0)
+        {
+            for (x = 0; x < count; x++)
+            {
+                map[x] = x;
+            }
+            for (x = count - 1; x > 0; x--)
+            {
+                const int other = rng() % (x + 1);
+                const uint32_t swap = map[x];
+
+                map[x] = map[other];
+                map[other] = swap;
+            }
+            channel.map = map;
+            channel.source = leds;
+        }
+
+        memset(expected, 0x5a, sizeof(expected));
+        memset(actual, 0x5a, sizeof(actual));
+        ws2811_prestage_scalar(&channel, first, count - first, expected);
+        ws2811_prestage(&channel, first, count - first, actual);
+        if (memcmp(expected, actual, (count - first) * ws2811_strip_colors(&channel)))
+        {
+            fail(channel.map ? "mapped prestage differs from reference" : "prestage differs from reference",
+                 "strip count first scale", channel.strip_type, count, first, scale);
+        }
+    }
+}
+
+static void test_transpose(int iterations)
+{
+    static uint8_t rows[WS2811_PLANE_CHANNELS * (MAX_BYTES + 16)];
+    static uint16_t expected[MAX_BYTES * 8], actual[MAX_BYTES * 8];
+    int i, row;
+
+    for (i = 0; i < iterations; i++)
+    {
+        const int count = (i % 2) ? rng() % 40 : rng() % MAX_BYTES;
+        const int stride = count + (rng() % 16);
+
+        for (row = 0; row < WS2811_PLANE_CHANNELS; row++)
+        {
+            fill_pattern(rows + row * stride, stride, (i + row) % PATTERN_COUNT);
+        }
+        ws2811_transpose_planes_scalar(rows, stride, count, expected);
+        ws2811_transpose_planes(rows, stride, count, actual);
+        if (memcmp(expected, actual, count * 8 * sizeof(uint16_t)))
+        {
+            fail("bit-planes differ from reference", "count stride", count, stride, 0, 0);
+        }
+    }
+}
+
+/**
+ * Frames rendered by a simulated driver, each changing a few runs of LEDs, decoded from the file
+ * the driver writes them to.  At full brightness and without gamma correction the decoded LEDs
+ * equal the LEDs that were rendered.  With shrink set, the channels lose a third of their LEDs
+ * halfway through, after which frames have to get shorter.  With truncate set, frames end after
+ * the last changed LED, the decoded LEDs are applied to a model of the strip which has to match
+ * the rendered LEDs.  Every frame has to end on a whole LED with the line low after it.
+ */
+static void test_driver(int gpionum0, int gpionum1, int count0, int count1, int timing, int strip_type, int frames,
+                        int shrink, int truncate)
+{
+    char path[] = "/tmp/ws2811-encoder-test-XXXXXX";
+    ws2811_led_t *expected[RPI_PWM_CHANNELS], *strip[RPI_PWM_CHANNELS], *sent_leds[RPI_PWM_CHANNELS];
+    const int init_count[RPI_PWM_CHANNELS] = {count0, count1};
+    int *frame_count = malloc(sizeof(int) * frames * RPI_PWM_CHANNELS);
+    int *frame_sent = malloc(sizeof(int) * frames * RPI_PWM_CHANNELS);
+    // room for the longest frame, 4 colors of 4 symbols per LED, twice over for interleaved PWM
+    const uint32_t golden_len = (32 * (count0 + count1)) + 4096;
+    uint8_t *golden = malloc(golden_len);
+    int sent_valid = 0;
+    ws2811_led_t *decoded = malloc(sizeof(ws2811_led_t) * (count0 > count1 ? count0 : count1));
+    uint8_t *bytes = malloc(4 * (count0 > count1 ? count0 : count1));
+    ws2811_t ws2811;
+    ws2811_sim_header_t header;
+    FILE *file;
+    uint32_t full_len = 0;
+    int fd, frame, chan, i;
+
+    fd = mkstemp(path);
+    close(fd);
+    setenv(WS2811_SIMULATE_ENV, path, 1);
+
+    memset(&ws2811, 0, sizeof(ws2811));
+    ws2811.freq = WS2811_TARGET_FREQ;
+    ws2811.dmanum = 10;
+    ws2811.timing = timing;
+    ws2811.render_truncate = truncate;
+    ws2811.channel[0].gpionum = gpionum0;
+    ws2811.channel[0].count = count0;
+    ws2811.channel[0].brightness = 255;
+    ws2811.channel[0].strip_type = strip_type;
+    ws2811.channel[1].gpionum = gpionum1;
+    ws2811.channel[1].count = count1;
+    ws2811.channel[1].brightness = 255;
+    ws2811.channel[1].strip_type = strip_type;
+    if (ws2811_init(&ws2811) != WS2811_SUCCESS)
+    {
+        fail("simulated driver init", "gpios counts", gpionum0, gpionum1, count0, count1);
+        return;
+    }
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        expected[chan] = calloc(frames * ws2811.channel[chan].count + 1, sizeof(ws2811_led_t));
+        strip[chan] = calloc(ws2811.channel[chan].count + 1, sizeof(ws2811_led_t));
+        sent_leds[chan] = calloc(ws2811.channel[chan].count + 1, sizeof(ws2811_led_t));
+    }
+
+    for (frame = 0; frame < frames; frame++)
+    {
+        for (chan = 0; shrink && (frame == frames / 2) && (chan < RPI_PWM_CHANNELS); chan++)
+        {
+            if ((ws2811_set_count(&ws2811, chan, ws2811.channel[chan].count + 1) == WS2811_SUCCESS) ||
+                (ws2811_set_count(&ws2811, chan, (ws2811.channel[chan].count * 2) / 3) != WS2811_SUCCESS))
+            {
+                fail("simulated driver count change", "gpios channel", gpionum0, gpionum1, chan, 0);
+            }
+            sent_valid = 0;
+        }
+
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            ws2811_channel_t *channel = &ws2811.channel[chan];
+            const ws2811_led_t mask = (0xffu << channel->rshift) | (0xffu << channel->gshift) |
+                                      (0xffu << channel->bshift) |
+                                      ((ws2811_strip_colors(channel) == 4) ? (0xffu << channel->wshift) : 0);
+            int run;
+
+            for (run = 0; channel->count && (run < 1 + frame % 4); run++)
+            {
+                const int first = rng() % channel->count;
+                const int last = first + (rng() % (channel->count - first)) + 1;
+
+                for (i = first; i < last; i++)
+                {
+                    channel->leds[i] = rng();
+                }
+            }
+            // a truncated frame ends after the last LED that changed since the one before
+            int sent = (truncate && sent_valid) ? 0 : channel->count;
+            for (i = 0; i < channel->count; i++)
+            {
+                expected[chan][frame * init_count[chan] + i] = channel->leds[i] & mask;
+                if (channel->leds[i] != sent_leds[chan][i])
+                {
+                    sent_leds[chan][i] = channel->leds[i];
+                    sent = (i + 1 > sent) ? i + 1 : sent;
+                }
+            }
+            frame_count[frame * RPI_PWM_CHANNELS + chan] = channel->count;
+            frame_sent[frame * RPI_PWM_CHANNELS + chan] = sent;
+        }
+        sent_valid = 1;
+
+        if (ws2811_render(&ws2811) != WS2811_SUCCESS)
+        {
+            fail("simulated driver render", "gpios frame", gpionum0, gpionum1, frame, 0);
+        }
+    }
+    ws2811_wait(&ws2811);
+
+    file = fopen(path, "rb");
+    for (frame = 0; file && (frame < frames) && (fread(&header, sizeof(header), 1, file) == 1); frame++)
+    {
+        uint8_t *raw = malloc(header.len);
+        int carry = 0;
+
+        if ((header.magic != WS2811_SIM_MAGIC) || (fread(raw, header.len, 1, file) != 1))
+        {
+            free(raw);
+            break;
+        }
+
+        // byte for byte what the loop of the first release lays out, zeros past the frame
+        ws2811_led_t *frame_leds[RPI_PWM_CHANNELS] =
+        {
+            expected[0] + frame * init_count[0], expected[1] + frame * init_count[1],
+        };
+        memset(golden, 0, golden_len);
+        frozen_render(ws2811.channel, frame_leds, frame_count + frame * RPI_PWM_CHANNELS,
+                      frame_sent + frame * RPI_PWM_CHANNELS, (gpionum0 != 10) && (gpionum0 != 21),
+                      header.layout, ws2811_get_timing(timing), golden);
+        for (i = header.len; (i < (int)golden_len) && !golden[i]; i++)
+        {
+        }
+        if ((header.len > golden_len) || memcmp(raw, golden, header.len) || (i < (int)golden_len))
+        {
+            fail("simulated frame differs from the reference", "gpios frame len", gpionum0, gpionum1, frame,
+                 header.len);
+        }
+
+        // after the shrink frames end with the fewer LEDs instead of the buffer at init
+        if (!frame)
+        {
+            full_len = header.len;
+        }
+        if (!truncate && (frame >= frames / 2) && ((header.len < full_len) != !!shrink))
+        {
+            fail("simulated frame length", "frame shrink bytes full", frame, shrink, header.len, full_len);
+        }
+
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            const ws2811_channel_t *channel = &ws2811.channel[chan];
+            const ws2811_timing_t *profile = ws2811_get_timing(timing);
+            const int count = frame_count[frame * RPI_PWM_CHANNELS + chan];
+            const int colors = ws2811_strip_colors(channel);
+            const int color_bytes = count * colors;
+            ws2811_decode_format_t format;
+            int sent_bytes;
+
+            format.layout = header.layout;
+            format.channel = (header.layout == WS2811_LAYOUT_PWM) ? chan : 0;
+            format.firstBit = carry;
+            format.symbols = header.symbols;
+            format.symbolHigh = profile->symbol_high;
+            format.symbolLow = profile->symbol_low;
+            format.invert = 0;
+
+            // a channel starts on the bit the previous one ended on
+            carry = (carry + color_bytes * 8 * profile->symbols) % 32;
+            if (!count)
+            {
+                continue;
+            }
+
+            // a truncated frame stops decoding where the line stays low
+            sent_bytes = ws2811_decode_bytes(&format, raw, header.len, bytes, color_bytes);
+            sent_bytes = sent_bytes ? sent_bytes - 1 : color_bytes;
+            if ((truncate ? sent_bytes % colors : sent_bytes != color_bytes) ||
+                !ws2811_decode_idle(&format, raw, header.len, 0, format.firstBit) ||
+                !ws2811_decode_idle(&format, raw, header.len, format.firstBit + sent_bytes * 8 * format.symbols,
+                                    UINT32_MAX))
+            {
+                fail("simulated frame does not end after its LEDs", "frame channel bytes sent", frame, chan,
+                     color_bytes, sent_bytes);
+                continue;
+            }
+            ws2811_decode_leds(channel, bytes, sent_bytes / colors, strip[chan]);
+            if (memcmp(strip[chan], expected[chan] + frame * init_count[chan], sizeof(ws2811_led_t) * count))
+            {
+                fail("simulated frame differs from its LEDs", "gpios frame channel", gpionum0, gpionum1, frame, chan);
+            }
+        }
+        free(raw);
+    }
+    if (frame != frames)
+    {
+        fail("simulated frames missing", "gpios frames", gpionum0, gpionum1, frame, frames);
+    }
+
+    if (file)
+    {
+        fclose(file);
+    }
+    ws2811_fini(&ws2811);
+    unlink(path);
+    unsetenv(WS2811_SIMULATE_ENV);
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        free(expected[chan]);
+        free(strip[chan]);
+        free(sent_leds[chan]);
+    }
+    free(frame_count);
+    free(frame_sent);
+    free(golden);
+    free(bytes);
+    free(decoded);
+}
+
+/**
+ * Two simulated drivers writing to the same file, as the PWM and SPI outputs of a board split
+ * in two do.  Every frame has to come out whole and tagged with the GPIO of its driver.
+ */
+static void test_shared_file(void)
+{
+    char path[] = "/tmp/ws2811-encoder-test-XXXXXX";
+    const int gpionums[2] = {18, 10};
+    static ws2811_led_t expected[2][SHARED_FRAMES][SHARED_LEDS];
+    ws2811_led_t decoded[SHARED_LEDS];
+    uint8_t bytes[3 * SHARED_LEDS];
+    const ws2811_timing_t *profile = ws2811_get_timing(WS2811_TIMING_DEFAULT);
+    ws2811_t drivers[2];
+    ws2811_sim_header_t header;
+    int sent[2] = {0, 0};
+    FILE *file;
+    int fd, frame, d, i;
+
+    fd = mkstemp(path);
+    close(fd);
+    setenv(WS2811_SIMULATE_ENV, path, 1);
+
+    for (d = 0; d < 2; d++)
+    {
+        memset(&drivers[d], 0, sizeof(drivers[d]));
+        drivers[d].freq = WS2811_TARGET_FREQ;
+        drivers[d].dmanum = 10;
+        drivers[d].channel[0].gpionum = gpionums[d];
+        drivers[d].channel[0].count = SHARED_LEDS;
+        drivers[d].channel[0].brightness = 255;
+        drivers[d].channel[0].strip_type = WS2811_STRIP_GRB;
+        if (ws2811_init(&drivers[d]) != WS2811_SUCCESS)
+        {
+            fail("simulated driver init", "gpio", gpionums[d], 0, 0, 0);
+            return;
+        }
+    }
+
+    for (frame = 0; frame < SHARED_FRAMES; frame++)
+    {
+        for (d = 0; d < 2; d++)
+        {
+            for (i = 0; i < SHARED_LEDS; i++)
+            {
+                drivers[d].channel[0].leds[i] = rng() & 0xffffff;
+                expected[d][frame][i] = drivers[d].channel[0].leds[i];
+            }
+            if (ws2811_render(&drivers[d]) != WS2811_SUCCESS)
+            {
+                fail("simulated driver render", "gpio frame", gpionums[d], frame, 0, 0);
+            }
+        }
+    }
+    // the file stays open until the last driver sharing it is done
+    ws2811_fini(&drivers[0]);
+    ws2811_fini(&drivers[1]);
+
+    file = fopen(path, "rb");
+    while (file && (fread(&header, sizeof(header), 1, file) == 1))
+    {
+        uint8_t *raw = malloc(header.len);
+        ws2811_decode_format_t format;
+
+        d = (header.gpionum == (uint32_t)gpionums[1]);
+        if ((header.magic != WS2811_SIM_MAGIC) || (header.gpionum != (uint32_t)gpionums[d]) ||
+            (sent[d] == SHARED_FRAMES) || (fread(raw, header.len, 1, file) != 1))
+        {
+            fail("shared simulated file has a broken frame", "gpio frame", header.gpionum, sent[d], 0, 0);
+            free(raw);
+            break;
+        }
+
+        memset(&format, 0, sizeof(format));
+        format.layout = header.layout;
+        format.symbols = header.symbols;
+        format.symbolHigh = profile->symbol_high;
+        format.symbolLow = profile->symbol_low;
+        if (ws2811_decode_bytes(&format, raw, header.len, bytes, sizeof(bytes)))
+        {
+            fail("shared simulated frame does not decode", "gpio frame", gpionums[d], sent[d], 0, 0);
+        }
+        else
+        {
+            ws2811_decode_leds(&drivers[d].channel[0], bytes, SHARED_LEDS, decoded);
+            if (memcmp(decoded, expected[d][sent[d]], sizeof(decoded)))
+            {
+                fail("shared simulated frame differs from its LEDs", "gpio frame", gpionums[d], sent[d], 0, 0);
+            }
+        }
+        sent[d]++;
+        free(raw);
+    }
+    if ((sent[0] != SHARED_FRAMES) || (sent[1] != SHARED_FRAMES))
+    {
+        fail("shared simulated frames missing", "frames", sent[0], sent[1], SHARED_FRAMES, 0);
+    }
+
+    if (file)
+    {
+        fclose(file);
+    }
+    unlink(path);
+    unsetenv(WS2811_SIMULATE_ENV);
+}
+
+/**
+ * The parallel GPIO driver in a simulated run.  Channels of different lengths and strip types,
+ * with gaps between them and some past the first byte of the bit-plane masks, have to come back
+ * out of the clear masks of every frame, and send only 0 bits past their end.
+ */
+static void test_parallel(void)
+{
+    char path[] = "/tmp/ws2811-parallel-test-XXXXXX";
+    static const struct
+    {
+        int chan;
+        int gpionum;
+        int count;
+        int strip_type;
+    } used[] =
+    {
+        {0, 18, PARALLEL_LEDS, WS2811_STRIP_GRB},
+        {1, 13, 37, WS2811_STRIP_RGB},
+        {4, 5, 90, SK6812_STRIP_GRBW},
+        {9, 27, 1, WS2811_STRIP_BGR},
+        {15, 2, 64, WS2811_STRIP_GBR},
+    };
+    const int used_count = sizeof(used) / sizeof(used[0]);
+    static ws2811_led_t expected[PARALLEL_FRAMES][WS2811_PARALLEL_CHANNELS][PARALLEL_LEDS];
+    ws2811_led_t decoded[PARALLEL_LEDS];
+    uint8_t bytes[4 * PARALLEL_LEDS];
+    ws2811_parallel_t parallel;
+    ws2811_sim_header_t header;
+    uint32_t pins = 0;
+    FILE *file;
+    int fd, frame, u, i, bits = 0;
+
+    fd = mkstemp(path);
+    close(fd);
+    setenv(WS2811_SIMULATE_ENV, path, 1);
+
+    // a channel with more bits than the mailbox has control blocks for is turned down
+    memset(&parallel, 0, sizeof(parallel));
+    parallel.freq = WS2811_TARGET_FREQ;
+    parallel.dmanum = 10;
+    parallel.channel[0].gpionum = 18;
+    parallel.channel[0].count = 4000;
+    if (ws2811_parallel_init(&parallel) != WS2811_ERROR_OUT_OF_MEMORY)
+    {
+        fail("parallel channel too long for the mailbox", "leds", parallel.channel[0].count, 0, 0, 0);
+        ws2811_parallel_fini(&parallel);
+    }
+
+    memset(&parallel, 0, sizeof(parallel));
+    parallel.freq = WS2811_TARGET_FREQ;
+    parallel.dmanum = 10;
+    for (u = 0; u < used_count; u++)
+    {
+        ws2811_channel_t *channel = &parallel.channel[used[u].chan];
+
+        channel->gpionum = used[u].gpionum;
+        channel->count = used[u].count;
+        channel->brightness = 255;
+        channel->strip_type = used[u].strip_type;
+        pins |= 1U << used[u].gpionum;
+    }
+    if (ws2811_parallel_init(&parallel) != WS2811_SUCCESS)
+    {
+        fail("simulated parallel driver init", "channels", used_count, 0, 0, 0);
+        unlink(path);
+        unsetenv(WS2811_SIMULATE_ENV);
+        return;
+    }
+    for (u = 0; u < used_count; u++)
+    {
+        const ws2811_channel_t *channel = &parallel.channel[used[u].chan];
+
+        if (channel->count * ws2811_strip_colors(channel) * 8 > bits)
+        {
+            bits = channel->count * ws2811_strip_colors(channel) * 8;
+        }
+    }
+
+    for (frame = 0; frame < PARALLEL_FRAMES; frame++)
+    {
+        for (u = 0; u < used_count; u++)
+        {
+            ws2811_channel_t *channel = &parallel.channel[used[u].chan];
+            const ws2811_led_t mask = ws2811_strip_colors(channel) == 4 ? 0xffffffff : 0xffffff;
+
+            for (i = 0; i < channel->count; i++)
+            {
+                channel->leds[i] = rng() & mask;
+                expected[frame][used[u].chan][i] = channel->leds[i];
+            }
+        }
+        if (ws2811_parallel_render(&parallel) != WS2811_SUCCESS)
+        {
+            fail("simulated parallel driver render", "frame", frame, 0, 0, 0);
+        }
+        if ((frame == PARALLEL_FRAMES - 1) && !ws2811_parallel_poll(&parallel) &&
+            (ws2811_parallel_wait(&parallel) != WS2811_SUCCESS || !ws2811_parallel_poll(&parallel)))
+        {
+            fail("simulated parallel frame not done after waiting", "frame", frame, 0, 0, 0);
+        }
+    }
+
+    file = fopen(path, "rb");
+    for (frame = 0; file && (fread(&header, sizeof(header), 1, file) == 1); frame++)
+    {
+        uint32_t *raw = malloc(header.len);
+
+        if ((header.magic != WS2811_SIM_MAGIC) || (header.layout != WS2811_LAYOUT_GPIO) ||
+            (header.gpionum != (uint32_t)used[0].gpionum) || (header.len != sizeof(uint32_t) * bits) ||
+            (frame == PARALLEL_FRAMES) || (fread(raw, header.len, 1, file) != 1))
+        {
+            fail("simulated parallel file has a broken frame", "frame len", frame, header.len, 0, 0);
+            free(raw);
+            break;
+        }
+
+        for (i = 0; i < bits; i++)
+        {
+            if (raw[i] & ~pins)
+            {
+                fail("parallel clear mask has pins of no channel", "frame bit", frame, i, 0, 0);
+                break;
+            }
+        }
+
+        for (u = 0; u < used_count; u++)
+        {
+            const ws2811_channel_t *channel = &parallel.channel[used[u].chan];
+            const int len = channel->count * ws2811_strip_colors(channel);
+
+            ws2811_decode_gpio(raw, header.len, channel->gpionum, bytes, len);
+            ws2811_decode_leds(channel, bytes, channel->count, decoded);
+            if (memcmp(decoded, expected[frame][used[u].chan], sizeof(ws2811_led_t) * channel->count))
+            {
+                fail("parallel frame differs from its LEDs", "frame chan", frame, used[u].chan, 0, 0);
+            }
+            for (i = len * 8; i < bits; i++)
+            {
+                if (!(raw[i] & (1U << channel->gpionum)))
+                {
+                    fail("parallel channel sends past its end", "frame chan bit", frame, used[u].chan, i, 0);
+                    break;
+                }
+            }
+        }
+        free(raw);
+    }
+    if (frame != PARALLEL_FRAMES)
+    {
+        fail("simulated parallel frames missing", "frames", frame, PARALLEL_FRAMES, 0, 0);
+    }
+
+    if (file)
+    {
+        fclose(file);
+    }
+    ws2811_parallel_fini(&parallel);
+    unlink(path);
+    unsetenv(WS2811_SIMULATE_ENV);
+}
+
+/**
+ * A board with LED_OUTPUT_PARALLEL, drawn through matrix-control.  Every panel has to come out
+ * on its own GPIO, in the order of the strip through the panel.
+ */
+static void test_parallel_outputs(void)
+{
+    char path[] = "/tmp/ws2811-outputs-test-XXXXXX";
+    const dimensions_t dimensions = {.width = 16, .height = 12};
+    const panel_t panels[] =
+    {
+        {.x = 0, .y = 0, .width = 16, .height = 4, .layout = LED_LAYOUT_ROWS},
+        {.x = 8, .y = 4, .width = 8, .height = 8, .layout = LED_LAYOUT_ROWS},
+        {.x = 0, .y = 4, .width = 8, .height = 5, .layout = LED_LAYOUT_ROWS},
+    };
+    const int gpionums[] = {18, 13, 12};
+    const int panel_count = sizeof(panels) / sizeof(panels[0]);
+    ws2811_led_t canvas[16 * 12];
+    ws2811_led_t decoded[16 * 4];
+    uint8_t bytes[3 * 16 * 4];
+    ws2811_channel_t strip;
+    ws2811_sim_header_t header;
+    ws2811_fence_t fence;
+    uint32_t *raw = NULL;
+    FILE *file;
+    int fd, p, i;
+
+    fd = mkstemp(path);
+    close(fd);
+    setenv(WS2811_SIMULATE_ENV, path, 1);
+
+    if (!ledInit(dimensions, 255, WS2811_TIMING_DEFAULT, panels, panel_count, LED_OUTPUT_PARALLEL))
+    {
+        fail("parallel outputs init", "panels", panel_count, 0, 0, 0);
+        unlink(path);
+        unsetenv(WS2811_SIMULATE_ENV);
+        return;
+    }
+    for (i = 0; i < 16 * 12; i++)
+    {
+        canvas[i] = rng() & 0xffffff;
+    }
+    if (!ledDrawFrameAsync(canvas, &fence) || !ledWaitFrame(fence) || !ledPollFrame(fence))
+    {
+        fail("parallel outputs draw", "fence", (int)fence, 0, 0, 0);
+    }
+    ledCleanUp();
+
+    memset(&strip, 0, sizeof(strip));
+    strip.strip_type = WS2811_STRIP_GBR;
+    strip.rshift = (WS2811_STRIP_GBR >> 16) & 0xff;
+    strip.gshift = (WS2811_STRIP_GBR >> 8) & 0xff;
+    strip.bshift = WS2811_STRIP_GBR & 0xff;
+
+    file = fopen(path, "rb");
+    if (!file || (fread(&header, sizeof(header), 1, file) != 1) || (header.layout != WS2811_LAYOUT_GPIO) ||
+        (header.gpionum != (uint32_t)gpionums[0]) || !(raw = malloc(header.len)) ||
+        (fread(raw, header.len, 1, file) != 1))
+    {
+        fail("parallel outputs frame missing", "panels", panel_count, 0, 0, 0);
+    }
+    else
+    {
+        for (p = 0; p < panel_count; p++)
+        {
+            const int count = panels[p].width * panels[p].height;
+
+            ws2811_decode_gpio(raw, header.len, gpionums[p], bytes, 3 * count);
+            ws2811_decode_leds(&strip, bytes, count, decoded);
+            for (i = 0; i < count; i++)
+            {
+                const int x = panels[p].x + (i % panels[p].width);
+                const int y = panels[p].y + (i / panels[p].width);
+
+                if (decoded[i] != canvas[(y * dimensions.width) + x])
+                {
+                    fail("parallel output shows the wrong pixel", "panel led", p, i, 0, 0);
+                    break;
+                }
+            }
+        }
+    }
+
+    free(raw);
+    if (file)
+    {
+        fclose(file);
+    }
+    unlink(path);
+    unsetenv(WS2811_SIMULATE_ENV);
+}
+
+/**
+ * Reads one frame of a simulated driver file.
+ *
+ * @returns  Number of frames in the file.
+ */
+static int read_sim_frame(const char *path, int index, uint8_t *raw, uint32_t size, uint32_t *len)
+{
+    static uint8_t skip[1 << 16];
+    ws2811_sim_header_t header;
+    FILE *file = fopen(path, "rb");
+    int frames = 0;
+
+    while (file && (fread(&header, sizeof(header), 1, file) == 1) && (header.len <= size) &&
+           (header.len <= sizeof(skip)) && (fread((frames == index) ? raw : skip, header.len, 1, file) == 1))
+    {
+        if (frames == index)
+        {
+            *len = header.len;
+        }
+        frames++;
+    }
+    if (file)
+    {
+        fclose(file);
+    }
+    return frames;
+}
+
+/**
+ * The skipped frame check of matrix-control across brightness changes.  ledSetBrightness redraws
+ * the frame, so drawing it again at the old brightness, like drawStill does through prepareStill,
+ * has to go out and match the first frame, while drawing it at the new one is skipped.
+ */
+static void test_brightness_redraw(void)
+{
+    char path[] = "/tmp/ws2811-brightness-test-XXXXXX";
+    const dimensions_t dimensions = {.width = 8, .height = 8};
+    static uint8_t first[1 << 16], again[1 << 16];
+    ws2811_led_t frame[8 * 8];
+    ws2811_fence_t fence;
+    uint64_t skipped;
+    uint32_t first_len = 0, again_len = 0;
+    int fd, frames, i;
+
+    fd = mkstemp(path);
+    close(fd);
+    setenv(WS2811_SIMULATE_ENV, path, 1);
+
+    for (i = 0; i < 8 * 8; i++)
+    {
+        frame[i] = rng() & 0xffffff;
+    }
+    if (!prepareStill(dimensions, 255) || !ledDrawFrameAsync(frame, &fence) || !ledWaitFrame(fence))
+    {
+        fail("brightness redraw init", "leds", 8 * 8, 0, 0, 0);
+        ledCleanUp();
+        unlink(path);
+        unsetenv(WS2811_SIMULATE_ENV);
+        return;
+    }
+    skipped = ledSkippedFrameCount();
+
+    ledSetBrightness(64);
+    prepareStill(dimensions, 255);
+    ledDrawFrameAsync(frame, &fence);
+    ledWaitFrame(fence);
+    if (ledSkippedFrameCount() != skipped)
+    {
+        fail("frame at the old brightness skipped", "skipped", (int)(ledSkippedFrameCount() - skipped), 0, 0, 0);
+    }
+
+    ledSetBrightness(64);
+    ledDrawFrameAsync(frame, &fence);
+    ledWaitFrame(fence);
+    if (ledSkippedFrameCount() != skipped + 1)
+    {
+        fail("frame at the new brightness drawn again", "skipped", (int)(ledSkippedFrameCount() - skipped), 0, 0, 0);
+    }
+    ledCleanUp();
+
+    frames = read_sim_frame(path, 0, first, sizeof(first), &first_len);
+    read_sim_frame(path, 2, again, sizeof(again), &again_len);
+    if ((frames != 4) || (first_len != again_len) || memcmp(first, again, first_len))
+    {
+        fail("frame at the old brightness not drawn again", "frames", frames, 0, 0, 0);
+    }
+
+    unlink(path);
+    unsetenv(WS2811_SIMULATE_ENV);
+}
+
+int main(int argc, char **argv)
+{
+    const int iterations = (argc > 1) ? atoi(argv[1]) : 2000;
+
+    test_encoders(iterations);
+    printf("encoders:  %d frames per variant, %d failures\n", iterations, failures);
+
+    test_prestage(iterations);
+    printf("prestage:  %d frames, %d failures\n", iterations, failures);
+
+    test_transpose(iterations);
+    printf("transpose: %d frames, %d failures\n", iterations, failures);
+
+    test_driver(18, 0, 300, 0, WS2811_TIMING_DEFAULT, WS2811_STRIP_GRB, 20, 0, 0);
+    test_driver(18, 13, 211, 97, WS2811_TIMING_DEFAULT, WS2811_STRIP_GRB, 20, 0, 0);
+    test_driver(18, 13, 150, 150, WS2811_TIMING_SK6812, SK6812_STRIP_GRBW, 20, 0, 0);
+    test_driver(0, 13, 0, 123, WS2811_TIMING_WS2811_400K, WS2811_STRIP_RGB, 10, 0, 0);
+    test_driver(21, 0, 333, 0, WS2811_TIMING_FAST, WS2811_STRIP_BGR, 20, 0, 0);
+    test_driver(10, 0, 250, 0, WS2811_TIMING_DEFAULT, SK6812_STRIP_RGBW, 20, 0, 0);
+    test_driver(18, 0, 5000, 0, WS2811_TIMING_DEFAULT, WS2811_STRIP_GRB, 6, 0, 0);
+    test_driver(18, 0, 300, 0, WS2811_TIMING_DEFAULT, WS2811_STRIP_GRB, 10, 1, 0);
+    test_driver(18, 13, 211, 97, WS2811_TIMING_DEFAULT, WS2811_STRIP_GRB, 10, 1, 0);
+    test_driver(10, 0, 250, 0, WS2811_TIMING_DEFAULT, WS2811_STRIP_GRB, 10, 1, 0);
+    test_driver(18, 13, 150, 150, WS2811_TIMING_SK6812, SK6812_STRIP_GRBW, 10, 1, 0);
+    test_driver(18, 0, 300, 0, WS2811_TIMING_DEFAULT, WS2811_STRIP_GRB, 20, 0, 1);
+    test_driver(18, 13, 211, 97, WS2811_TIMING_DEFAULT, WS2811_STRIP_GRB, 20, 0, 1);
+    test_driver(18, 13, 150, 150, WS2811_TIMING_SK6812, SK6812_STRIP_GRBW, 20, 0, 1);
+    test_driver(21, 0, 333, 0, WS2811_TIMING_FAST, WS2811_STRIP_BGR, 20, 0, 1);
+    test_driver(10, 0, 250, 0, WS2811_TIMING_DEFAULT, SK6812_STRIP_RGBW, 20, 0, 1);
+    test_driver(18, 13, 211, 97, WS2811_TIMING_DEFAULT, WS2811_STRIP_GRB, 10, 1, 1);
+    test_shared_file();
+    test_parallel();
+    test_parallel_outputs();
+    test_brightness_redraw();
+    printf("driver:    simulated frames, %d failures\n", failures);
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,198 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "workers.h"
+
+struct ws2811_workers
+{
+    pthread_mutex_t lock;
+    pthread_cond_t start;                        // Signaled when a batch is posted or on shutdown
+    pthread_cond_t done;                         // Signaled when the last worker leaves a batch
+    pthread_t *threads;
+    int count;
+    int started;                                 // Threads that have taken their thread index
+    int shutdown;
+    unsigned int batch;                          // Incremented for every posted batch
+    int busy;                                    // Workers still inside the current batch
+    ws2811_work_t work;
+    void *arg;
+    int items;
+    int next_item;                               // Next item to take, shared with the caller
+};
+
+/**
+ * Take items of the current batch until none are left.  Called without the lock held.
+ *
+ * @param    workers  Worker pool.
+ * @param    thread   Index of the calling thread.
+ *
+ * @returns  None
+ */
+static void run_items(ws2811_workers_t *workers, int thread)
+{
+    int index;
+
+    while ((index = __atomic_fetch_add(&workers->next_item, 1, __ATOMIC_RELAXED)) < workers->items)
+    {
+        workers->work(workers->arg, index, thread);
+    }
+}
+
+static void *worker_main(void *data)
+{
+    ws2811_workers_t *workers = data;
+    unsigned int seen = 0;
+    int thread;
+
+    pthread_mutex_lock(&workers->lock);
+    thread = ++workers->started;
+    while (1)
+    {
+        while (!workers->shutdown && (workers->batch == seen))
+        {
+            pthread_cond_wait(&workers->start, &workers->lock);
+        }
+        if (workers->shutdown)
+        {
+            break;
+        }
+        seen = workers->batch;
+        pthread_mutex_unlock(&workers->lock);
+
+        run_items(workers, thread);
+
+        pthread_mutex_lock(&workers->lock);
+        if (--workers->busy == 0)
+        {
+            pthread_cond_signal(&workers->done);
+        }
+    }
+    pthread_mutex_unlock(&workers->lock);
+
+    return NULL;
+}
+
+/**
+ * Start a pool of worker threads that wait for batches from ws2811_workers_run.
+ *
+ * @param    count  Number of threads besides the caller, at least 1.
+ *
+ * @returns  Worker pool, NULL if it could not be started.
+ */
+ws2811_workers_t *ws2811_workers_create(int count)
+{
+    ws2811_workers_t *workers;
+    int i;
+
+    workers = calloc(1, sizeof(*workers));
+    if (!workers)
+    {
+        return NULL;
+    }
+
+    workers->threads = calloc(count, sizeof(pthread_t));
+    if (!workers->threads)
+    {
+        free(workers);
+        return NULL;
+    }
+
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->start, NULL);
+    pthread_cond_init(&workers->done, NULL);
+
+    for (i = 0; i < count; i++)
+    {
+        if (pthread_create(&workers->threads[i], NULL, worker_main, workers))
+        {
+            break;
+        }
+        workers->count++;
+    }
+
+    if (!workers->count)
+    {
+        ws2811_workers_destroy(workers);
+        return NULL;
+    }
+
+    return workers;
+}
+
+/**
+ * Number of threads in the pool, not counting the caller of ws2811_workers_run.
+ *
+ * @param    workers  Worker pool.
+ *
+ * @returns  Thread count.
+ */
+int ws2811_workers_count(const ws2811_workers_t *workers)
+{
+    return workers->count;
+}
+
+/**
+ * Run work for every item index of a batch, spread over the pool and the calling thread.
+ * Returns once all items are done.
+ *
+ * @param    workers  Worker pool.
+ * @param    work     Function to run for each item.
+ * @param    arg      Argument passed to work.
+ * @param    items    Number of items.
+ *
+ * @returns  None
+ */
+void ws2811_workers_run(ws2811_workers_t *workers, ws2811_work_t work, void *arg, int items)
+{
+    pthread_mutex_lock(&workers->lock);
+    workers->work = work;
+    workers->arg = arg;
+    workers->items = items;
+    workers->next_item = 0;
+    workers->busy = workers->count;
+    workers->batch++;
+    pthread_cond_broadcast(&workers->start);
+    pthread_mutex_unlock(&workers->lock);
+
+    run_items(workers, 0);
+
+    pthread_mutex_lock(&workers->lock);
+    while (workers->busy)
+    {
+        pthread_cond_wait(&workers->done, &workers->lock);
+    }
+    pthread_mutex_unlock(&workers->lock);
+}
+
+/**
+ * Stop and free a worker pool.
+ *
+ * @param    workers  Worker pool, may be NULL.
+ *
+ * @returns  None
+ */
+void ws2811_workers_destroy(ws2811_workers_t *workers)
+{
+    int i;
+
+    if (!workers)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&workers->lock);
+    workers->shutdown = 1;
+    pthread_cond_broadcast(&workers->start);
+    pthread_mutex_unlock(&workers->lock);
+
+    for (i = 0; i < workers->count; i++)
+    {
+        pthread_join(workers->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&workers->done);
+    pthread_cond_destroy(&workers->start);
+    pthread_mutex_destroy(&workers->lock);
+    free(workers->threads);
+    free(workers);
+}
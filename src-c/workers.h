@@ -0,0 +1,30 @@
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * Runs one item of a batch.
+     *
+     * @param arg     Argument given to ws2811_workers_run.
+     * @param index   Index of the item, below the item count of the batch.
+     * @param thread  Index of the thread running the item, 0 for the caller of ws2811_workers_run
+     *                and up to ws2811_workers_count for the pool.
+     */
+    typedef void (*ws2811_work_t)(void *arg, int index, int thread);
+
+    typedef struct ws2811_workers ws2811_workers_t;
+
+    ws2811_workers_t *ws2811_workers_create(int count);
+    int ws2811_workers_count(const ws2811_workers_t *workers);
+    void ws2811_workers_run(ws2811_workers_t *workers, ws2811_work_t work, void *arg, int items);
+    void ws2811_workers_destroy(ws2811_workers_t *workers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __WORKERS_H__ */
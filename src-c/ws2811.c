@@ -37,48 +37,72 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <signal.h>
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
 #include <time.h>
 #include <math.h>
+#include <errno.h>
+#include <pthread.h>
 #include "clk.h"
 #include "dma.h"
 #include "gpio.h"
 #include "mailbox.h"
 #include "pcm.h"
 #include "pwm.h"
+#include "periph.h"
 #include "rpihw.h"
 
 #include "ws2811.h"
+#include "encoder.h"
+#include "workers.h"
 
 
-#define BUS_TO_PHYS(x)                           ((x)&~0xC0000000)
+/* 8 bits per color byte, 3 or 4 symbols per bit + the reset time of the timing profile */
+#define SYMBOL_FREQ(timing)                      ((timing)->freq * (timing)->symbols)
+#define LED_RESET_BIT_COUNT(timing)              (((uint64_t)(timing)->reset_us * SYMBOL_FREQ(timing)) / 1000000)
+#define LED_BIT_COUNT(color_bytes, timing)       (((color_bytes) * 8 * (timing)->symbols) + \
+                                                  LED_RESET_BIT_COUNT(timing))
 
-#define OSC_FREQ                                 19200000   // crystal frequency
-#define OSC_FREQ_PI4                             54000000   // Pi 4 crystal frequency
+/* Unchanged LEDs in a row that end a run of changed LEDs to re-encode. */
+#define DIRTY_RUN_GAP                            8
 
-/* 4 colors (R, G, B + W), 8 bits per byte, 3 symbols per bit + 55uS low for reset signal */
-#define LED_COLOURS                              4
-#define LED_RESET_uS                             55
-#define LED_BIT_COUNT(leds, freq)                ((leds * LED_COLOURS * 8 * 3) + ((LED_RESET_uS * \
-                                                  (freq * 3)) / 1000000))
+/* Encoding is spread over worker threads from this many LEDs per frame, in chunks of at least
+ * ENCODE_CHUNK_LEDS.  Below that waking the threads costs more than it saves. */
+#define PARALLEL_ENCODE_MIN_LEDS                 4096
+#define ENCODE_CHUNK_LEDS                        512
+#define ENCODE_MAX_WORKERS                       3
 
-/* Minimum time to wait for reset to occur in microseconds. */
-#define LED_RESET_WAIT_TIME                      300
+/* Upper bound of queued encode jobs per channel: runs are separated by at least
+ * DIRTY_RUN_GAP LEDs and long runs are split into chunks. */
+#define ENCODE_JOB_COUNT(leds)                   ((2 * (((leds) / (DIRTY_RUN_GAP + 1)) + 1)) + \
+                                                  ((leds) / ENCODE_CHUNK_LEDS))
 
 // Pad out to the nearest uint32 + 32-bits for idle low/high times the number of channels
-#define PWM_BYTE_COUNT(leds, freq)               (((((LED_BIT_COUNT(leds, freq) >> 3) & ~0x7) + 4) + 4) * \
-                                                  RPI_PWM_CHANNELS)
-#define PCM_BYTE_COUNT(leds, freq)               ((((LED_BIT_COUNT(leds, freq) >> 3) & ~0x7) + 4) + 4)
+#define PWM_BYTE_COUNT(color_bytes, timing, channels) \
+                                                 (((((LED_BIT_COUNT(color_bytes, timing) >> 3) & ~0x7) + 4) + 4) * \
+                                                  (channels))
+#define PCM_BYTE_COUNT(color_bytes, timing)      ((((LED_BIT_COUNT(color_bytes, timing) >> 3) & ~0x7) + 4) + 4)
 
-// Symbol definitions
+// Low time for reset of one channel when a frame is cut short, rounded up to 64 bits
+#define LED_RESET_BYTE_COUNT(timing)             (((LED_RESET_BIT_COUNT(timing) + 63) / 64) * 8)
+
+// Symbol definitions, software inversion (PCM and SPI only) sends their complement:
+// 0 0 1 and 0 1 1
 #define SYMBOL_HIGH                              0x6  // 1 1 0
 #define SYMBOL_LOW                               0x4  // 1 0 0
 
-// Symbol definitions for software inversion (PCM and SPI only)
-#define SYMBOL_HIGH_INV                          0x1  // 0 0 1
-#define SYMBOL_LOW_INV                           0x3  // 0 1 1
+// Symbols for 4 symbols per bit, 1 0 0 0 and 1 1 0 0
+#define SYMBOL4_HIGH                             0xc  // 1 1 0 0
+#define SYMBOL4_LOW                              0x8  // 1 0 0 0
+
+// Number of DMA buffers, the next frame is written to one while the other is being sent
+#define PXL_RAW_COUNT                            2
+
+// spidev rejects messages larger than its bufsiz module parameter, 4096 unless changed
+#define SPI_BUFSIZ_PATH                          "/sys/module/spidev/parameters/bufsiz"
+#define SPI_BUFSIZ_DEFAULT                       4096
 
 // Driver mode definitions
 #define NONE	0
@@ -86,35 +110,117 @@
 #define PCM	2
 #define SPI	3
 
-// We use the mailbox interface to request memory from the VideoCore.
-// This lets us request one physically contiguous chunk, find its
-// physical address, and map it 'uncached' so that writes from this
-// code are immediately visible to the DMA controller.  This struct
-// holds data relevant to the mailbox interface.
-typedef struct videocore_mbox {
-    int handle;             /* From mbox_open() */
-    unsigned mem_ref;       /* From mem_alloc() */
-    unsigned bus_addr;      /* From mem_lock() */
-    unsigned size;          /* Size of allocation */
-    uint8_t *virt_addr;     /* From mapmem() */
-} videocore_mbox_t;
+typedef struct
+{
+    int chan;
+    int first;                                   // First LED of the run
+    int count;                                   // LEDs in the run
+    uint32_t *words;                             // First word of the channel
+    int carry_bits;                              // Bits of the first word used by the previous channel
+} encode_job_t;
 
 typedef struct ws2811_device
 {
     int driver_mode;
-    volatile uint8_t *pxl_raw;
+    int simulated;                               // No hardware, frames only go to sim_fd
+    int sim_fd;                                  // File the frames of a simulated driver go to, -1 if none
+    int sim_gpionum;                             // GPIO the frames are tagged with in a shared file
+    volatile uint8_t *pxl_raw[PXL_RAW_COUNT];    // DMA buffers, plain memory for SPI
+    int pxl_next;                                // Index of the pxl_raw buffer for the next frame
+    uint32_t pxl_len;                            // Size of one pxl_raw buffer in bytes
     volatile dma_t *dma;
     volatile pwm_t *pwm;
     volatile pcm_t *pcm;
     int spi_fd;
-    volatile dma_cb_t *dma_cb;
-    uint32_t dma_cb_addr;
+    pthread_t spi_thread;                        // Sends the queued frame while the next is rendered
+    int spi_thread_started;
+    pthread_mutex_t spi_lock;
+    pthread_cond_t spi_queue_cond;               // Signaled when a frame is queued or on shutdown
+    pthread_cond_t spi_done_cond;                // Signaled when the queued frame has been sent
+    int spi_queued;                              // Index of the pxl_raw buffer to send next, -1 if none
+    uint32_t spi_len[PXL_RAW_COUNT];             // Bytes to send from each pxl_raw buffer
+    int spi_busy;                                // Non-zero from queuing a frame until it is sent
+    int spi_shutdown;
+    ws2811_return_t spi_result;                  // Result of the last transfer
+    volatile dma_cb_t *dma_cb[PXL_RAW_COUNT];    // Control block sending the matching pxl_raw
+    uint32_t dma_cb_addr[PXL_RAW_COUNT];
     volatile gpio_t *gpio;
     volatile cm_clk_t *cm_clk;
     videocore_mbox_t mbox;
     int max_count;
+    int init_count[RPI_PWM_CHANNELS];            // LEDs of each channel the buffers are sized for
+    int max_color_bytes;                         // Color bytes of the channel with the most of them
+    int pwm_channels;                            // Channels interleaved in a PWM buffer, 1 or 2
+    ws2811_timing_t timing;                      // Timing profile in use, freq filled in
+    int byte_bits;                               // Bits on the wire for every color byte
+    ws2811_fence_t fence;                        // Fence of the last frame handed to the hardware
+    int color_lut_brightness[RPI_PWM_CHANNELS];  // Brightness the color_lut was built for, -1 if stale
+    const uint8_t *color_lut_gamma[RPI_PWM_CHANNELS];  // Gamma table the color_lut was built from
+    uint64_t wire_time_ns;                       // Time it takes to send one pxl_raw buffer
+    uint32_t tx_len;                             // Bytes of pxl_raw sent for the current frame
+    uint64_t dma_deadline_ns;                    // Expected end of the frame on the wire
+    uint64_t render_timestamp_ns;                // Start of the previous frame
+    uint32_t symbol_lut[256];                    // Symbol bits of each color byte
+    ws2811_encoder_t encoder[RPI_PWM_CHANNELS];  // Encoder matching the mode and strip of a channel
+    uint8_t *color_bytes;                        // Prestaged color bytes, one part per encoding thread
+    uint32_t color_bytes_len;                    // Size of the part of each thread
+    int worker_count;                            // Threads that can help encoding long frames
+    ws2811_workers_t *workers;                   // Those threads once started, NULL before
+    encode_job_t *jobs;                          // Runs of LEDs queued for encoding
+    int job_count;
+    int job_leds;                                // LEDs in all queued jobs
+    ws2811_led_t *shadow_leds[PXL_RAW_COUNT][RPI_PWM_CHANNELS];  // LEDs as they are encoded in each pxl_raw
+    int shadow_count[PXL_RAW_COUNT][RPI_PWM_CHANNELS];          // Leading LEDs of shadow_leds still encoded
+    ws2811_led_t *sent_leds[RPI_PWM_CHANNELS];   // LEDs as the strip shows them, for render_truncate
+    int sent_valid[RPI_PWM_CHANNELS];            // Zero if sent_leds no longer matches the strip
 } ws2811_device_t;
 
+// Bit rate, symbols and reset time of each WS2811_TIMING_xxx profile.  The symbols of a bit
+// are sent at freq * symbols, so shorter symbols need more of them for the same high times.
+static const ws2811_timing_t timing_profiles[WS2811_TIMING_COUNT] =
+{
+    [WS2811_TIMING_DEFAULT] =
+    {
+        .freq = 0,
+        .symbols = 3,
+        .symbol_high = SYMBOL_HIGH,              // 833ns high at 800kHz
+        .symbol_low = SYMBOL_LOW,                // 417ns high at 800kHz
+        .reset_us = 300,
+    },
+    [WS2811_TIMING_WS2812B] =
+    {
+        .freq = 800000,
+        .symbols = 3,
+        .symbol_high = SYMBOL_HIGH,              // 833ns high
+        .symbol_low = SYMBOL_LOW,                // 417ns high
+        .reset_us = 300,                         // Newer chips latch after 280µs
+    },
+    [WS2811_TIMING_SK6812] =
+    {
+        .freq = 800000,
+        .symbols = 4,
+        .symbol_high = SYMBOL4_HIGH,             // 625ns high
+        .symbol_low = SYMBOL4_LOW,               // 313ns high
+        .reset_us = 80,
+    },
+    [WS2811_TIMING_WS2811_400K] =
+    {
+        .freq = 400000,
+        .symbols = 4,
+        .symbol_high = SYMBOL4_HIGH,             // 1250ns high
+        .symbol_low = SYMBOL4_LOW,               // 625ns high
+        .reset_us = 55,
+    },
+    [WS2811_TIMING_FAST] =
+    {
+        .freq = 1000000,
+        .symbols = 3,
+        .symbol_high = SYMBOL_HIGH,              // 667ns high
+        .symbol_low = SYMBOL_LOW,                // 333ns high
+        .reset_us = 55,
+    },
+};
+
 /**
  * Provides monotonic timestamp in microseconds.
  *
@@ -153,6 +259,56 @@ static int max_channel_led_count(ws2811_t *ws2811)
     return max;
 }
 
+/**
+ * Find the channel with the most color bytes (LEDs times colors of its strip type).
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  Number of color bytes.
+ */
+static int max_channel_color_bytes(ws2811_t *ws2811)
+{
+    int chan, max = 0;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        const int color_bytes = ws2811->channel[chan].count * ws2811_strip_colors(&ws2811->channel[chan]);
+
+        if (color_bytes > max)
+        {
+            max = color_bytes;
+        }
+    }
+
+    return max;
+}
+
+/**
+ * Build the symbol lookup table.  Each entry holds the 24 or 32 symbol bits (3 or 4 symbols
+ * per bit, MSB first) that represent one color byte on the wire.
+ *
+ * @param    lut     Table of 256 entries to fill.
+ * @param    timing  Timing profile with the symbols of a bit.
+ *
+ * @returns  None
+ */
+static void symbol_lut_init(uint32_t *lut, const ws2811_timing_t *timing)
+{
+    int value, k;
+
+    for (value = 0; value < 256; value++)
+    {
+        uint32_t bits = 0;
+
+        for (k = 7; k >= 0; k--)
+        {
+            bits = (bits << timing->symbols) | ((value & (1 << k)) ? timing->symbol_high : timing->symbol_low);
+        }
+
+        lut[value] = bits;
+    }
+}
+
 /**
  * Map all devices into userspace memory.
  * Not called for SPI
@@ -265,47 +421,6 @@ static void unmap_registers(ws2811_t *ws2811)
     }
 }
 
-/**
- * Given a userspace address pointer, return the matching bus address used by DMA.
- *     Note: The bus address is not the same as the CPU physical address.
- *
- * @param    addr   Userspace virtual address pointer.
- *
- * @returns  Bus address for use by DMA.
- */
-static uint32_t addr_to_bus(ws2811_device_t *device, const volatile void *virt)
-{
-    videocore_mbox_t *mbox = &device->mbox;
-
-    uint32_t offset = (uint8_t *)virt - mbox->virt_addr;
-
-    return mbox->bus_addr + offset;
-}
-
-/**
- * Stop the PWM controller.
- *
- * @param    ws2811  ws2811 instance pointer.
- *
- * @returns  None
- */
-static void stop_pwm(ws2811_t *ws2811)
-{
-    ws2811_device_t *device = ws2811->device;
-    volatile pwm_t *pwm = device->pwm;
-    volatile cm_clk_t *cm_clk = device->cm_clk;
-
-    // Turn off the PWM in case already running
-    pwm->ctl = 0;
-    usleep(10);
-
-    // Kill the clock if it was already running
-    cm_clk->ctl = CM_CLK_CTL_PASSWD | CM_CLK_CTL_KILL;
-    usleep(10);
-    while (cm_clk->ctl & CM_CLK_CTL_BUSY)
-        ;
-}
-
 /**
  * Stop the PCM controller.
  *
@@ -323,11 +438,7 @@ static void stop_pcm(ws2811_t *ws2811)
     pcm->cs = 0;
     usleep(10);
 
-    // Kill the clock if it was already running
-    cm_clk->ctl = CM_CLK_CTL_PASSWD | CM_CLK_CTL_KILL;
-    usleep(10);
-    while (cm_clk->ctl & CM_CLK_CTL_BUSY)
-        ;
+    clk_stop(cm_clk);
 }
 
 /**
@@ -341,70 +452,55 @@ static int setup_pwm(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
     volatile dma_t *dma = device->dma;
-    volatile dma_cb_t *dma_cb = device->dma_cb;
-    volatile pwm_t *pwm = device->pwm;
-    volatile cm_clk_t *cm_clk = device->cm_clk;
-    int maxcount = device->max_count;
-    uint32_t freq = ws2811->freq;
-    int32_t byte_count;
-
-    const rpi_hw_t *rpi_hw = ws2811->rpi_hw;
-    const uint32_t rpi_type = rpi_hw->type;
-    uint32_t osc_freq = OSC_FREQ;
-
-    if(rpi_type == RPI_HWVER_TYPE_PI4){
-        osc_freq = OSC_FREQ_PI4;
-    }
-
-    stop_pwm(ws2811);
+    uint32_t ctl = 0, enable = 0;
+    int i;
 
-    // Setup the Clock - Use OSC @ 19.2Mhz w/ 3 clocks/tick
-    cm_clk->div = CM_CLK_DIV_PASSWD | CM_CLK_DIV_DIVI(osc_freq / (3 * freq));
-    cm_clk->ctl = CM_CLK_CTL_PASSWD | CM_CLK_CTL_SRC_OSC;
-    cm_clk->ctl = CM_CLK_CTL_PASSWD | CM_CLK_CTL_SRC_OSC | CM_CLK_CTL_ENAB;
-    usleep(10);
-    while (!(cm_clk->ctl & CM_CLK_CTL_BUSY))
-        ;
+    pwm_stop(device->pwm, device->cm_clk);
 
-    // Setup the PWM, use delays as the block is rumored to lock up without them.  Make
-    // sure to use a high enough priority to avoid any FIFO underruns, especially if
-    // the CPU is busy doing lots of memory accesses, or another DMA controller is
-    // busy.  The FIFO will clock out data at a much slower rate (2.6Mhz max), so
-    // the odds of a DMA priority boost are extremely low.
+    // Setup the Clock - Use OSC @ 19.2Mhz w/ 3 or 4 clocks/tick
+    clk_start(device->cm_clk, rpi_osc_freq(ws2811->rpi_hw) / SYMBOL_FREQ(&device->timing));
 
-    pwm->rng1 = 32;  // 32-bits per word to serialize
-    usleep(10);
-    pwm->ctl = RPI_PWM_CTL_CLRF1;
-    usleep(10);
-    pwm->dmac = RPI_PWM_DMAC_ENAB | RPI_PWM_DMAC_PANIC(7) | RPI_PWM_DMAC_DREQ(3);
-    usleep(10);
-    pwm->ctl = RPI_PWM_CTL_USEF1 | RPI_PWM_CTL_MODE1 |
-               RPI_PWM_CTL_USEF2 | RPI_PWM_CTL_MODE2;
+    // The FIFO will clock out data at a much slower rate (2.6Mhz max), so the odds of a DMA
+    // priority boost are extremely low.  Words from the FIFO alternate between the channels that use it, so a single channel
+    // gets every word and its buffer is not interleaved
+    if ((device->pwm_channels == RPI_PWM_CHANNELS) || (ws2811->channel[0].count) || !(ws2811->channel[1].count))
+    {
+        ctl |= RPI_PWM_CTL_USEF1 | RPI_PWM_CTL_MODE1;
+        enable |= RPI_PWM_CTL_PWEN1;
+    }
+    if ((device->pwm_channels == RPI_PWM_CHANNELS) || (!ws2811->channel[0].count && ws2811->channel[1].count))
+    {
+        ctl |= RPI_PWM_CTL_USEF2 | RPI_PWM_CTL_MODE2;
+        enable |= RPI_PWM_CTL_PWEN2;
+    }
     if (ws2811->channel[0].invert)
     {
-        pwm->ctl |= RPI_PWM_CTL_POLA1;
+        ctl |= RPI_PWM_CTL_POLA1;
     }
     if (ws2811->channel[1].invert)
     {
-        pwm->ctl |= RPI_PWM_CTL_POLA2;
+        ctl |= RPI_PWM_CTL_POLA2;
     }
-    usleep(10);
-    pwm->ctl |= RPI_PWM_CTL_PWEN1 | RPI_PWM_CTL_PWEN2;
+    pwm_dma_setup(device->pwm, 32, ctl, enable);  // 32-bits per word to serialize
+
+    // Initialize a DMA control block for each buffer
+    for (i = 0; i < PXL_RAW_COUNT; i++)
+    {
+        volatile dma_cb_t *dma_cb = device->dma_cb[i];
 
-    // Initialize the DMA control block
-    byte_count = PWM_BYTE_COUNT(maxcount, freq);
-    dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
-                 RPI_DMA_TI_WAIT_RESP |       // wait for write complete
-                 RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
-                 RPI_DMA_TI_PERMAP(5) |       // PWM peripheral
-                 RPI_DMA_TI_SRC_INC;          // Increment src addr
+        dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
+                     RPI_DMA_TI_WAIT_RESP |       // wait for write complete
+                     RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
+                     RPI_DMA_TI_PERMAP(5) |       // PWM peripheral
+                     RPI_DMA_TI_SRC_INC;          // Increment src addr
 
-    dma_cb->source_ad = addr_to_bus(device, device->pxl_raw);
+        dma_cb->source_ad = addr_to_bus(&device->mbox, device->pxl_raw[i]);
 
-    dma_cb->dest_ad = (uintptr_t)&((pwm_t *)PWM_PERIPH_PHYS)->fif1;
-    dma_cb->txfr_len = byte_count;
-    dma_cb->stride = 0;
-    dma_cb->nextconbk = 0;
+        dma_cb->dest_ad = (uintptr_t)&((pwm_t *)PWM_PERIPH_PHYS)->fif1;
+        dma_cb->txfr_len = device->pxl_len;
+        dma_cb->stride = 0;
+        dma_cb->nextconbk = 0;
+    }
 
     dma->cs = 0;
     dma->txfr_len = 0;
@@ -423,31 +519,13 @@ static int setup_pcm(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
     volatile dma_t *dma = device->dma;
-    volatile dma_cb_t *dma_cb = device->dma_cb;
     volatile pcm_t *pcm = device->pcm;
-    volatile cm_clk_t *cm_clk = device->cm_clk;
-    //int maxcount = max_channel_led_count(ws2811);
-    int maxcount = device->max_count;
-    uint32_t freq = ws2811->freq;
-    int32_t byte_count;
-
-    const rpi_hw_t *rpi_hw = ws2811->rpi_hw;
-    const uint32_t rpi_type = rpi_hw->type;
-    uint32_t osc_freq = OSC_FREQ;
-
-    if(rpi_type == RPI_HWVER_TYPE_PI4){
-        osc_freq = OSC_FREQ_PI4;
-    }
+    int i;
 
     stop_pcm(ws2811);
 
-    // Setup the PCM Clock - Use OSC @ 19.2Mhz w/ 3 clocks/tick
-    cm_clk->div = CM_CLK_DIV_PASSWD | CM_CLK_DIV_DIVI(osc_freq / (3 * freq));
-    cm_clk->ctl = CM_CLK_CTL_PASSWD | CM_CLK_CTL_SRC_OSC;
-    cm_clk->ctl = CM_CLK_CTL_PASSWD | CM_CLK_CTL_SRC_OSC | CM_CLK_CTL_ENAB;
-    usleep(10);
-    while (!(cm_clk->ctl & CM_CLK_CTL_BUSY))
-        ;
+    // Setup the PCM Clock - Use OSC @ 19.2Mhz w/ 3 or 4 clocks/tick
+    clk_start(device->cm_clk, rpi_osc_freq(ws2811->rpi_hw) / SYMBOL_FREQ(&device->timing));
 
     // Setup the PCM, use delays as the block is rumored to lock up without them.  Make
     // sure to use a high enough priority to avoid any FIFO underruns, especially if
@@ -465,19 +543,23 @@ static int setup_pcm(ws2811_t *ws2811)
     pcm->cs |= RPI_PCM_CS_DMAEN;         // Enable DMA DREQ
     pcm->dreq = (RPI_PCM_DREQ_TX(0x3F) | RPI_PCM_DREQ_TX_PANIC(0x10)); // Set FIFO tresholds
 
-    // Initialize the DMA control block
-    byte_count = PCM_BYTE_COUNT(maxcount, freq);
-    dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
-                 RPI_DMA_TI_WAIT_RESP |       // wait for write complete
-                 RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
-                 RPI_DMA_TI_PERMAP(2) |       // PCM TX peripheral
-                 RPI_DMA_TI_SRC_INC;          // Increment src addr
+    // Initialize a DMA control block for each buffer
+    for (i = 0; i < PXL_RAW_COUNT; i++)
+    {
+        volatile dma_cb_t *dma_cb = device->dma_cb[i];
+
+        dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
+                     RPI_DMA_TI_WAIT_RESP |       // wait for write complete
+                     RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
+                     RPI_DMA_TI_PERMAP(2) |       // PCM TX peripheral
+                     RPI_DMA_TI_SRC_INC;          // Increment src addr
 
-    dma_cb->source_ad = addr_to_bus(device, device->pxl_raw);
-    dma_cb->dest_ad = (uintptr_t)&((pcm_t *)PCM_PERIPH_PHYS)->fifo;
-    dma_cb->txfr_len = byte_count;
-    dma_cb->stride = 0;
-    dma_cb->nextconbk = 0;
+        dma_cb->source_ad = addr_to_bus(&device->mbox, device->pxl_raw[i]);
+        dma_cb->dest_ad = (uintptr_t)&((pcm_t *)PCM_PERIPH_PHYS)->fifo;
+        dma_cb->txfr_len = device->pxl_len;
+        dma_cb->stride = 0;
+        dma_cb->nextconbk = 0;
+    }
 
     dma->cs = 0;
     dma->txfr_len = 0;
@@ -490,28 +572,16 @@ static int setup_pcm(ws2811_t *ws2811)
  * PWM channels.
  *
  * @param    ws2811  ws2811 instance pointer.
+ * @param    index   Index of the pxl_raw buffer to send.
  *
  * @returns  None
  */
-static void dma_start(ws2811_t *ws2811)
+static void dma_start(ws2811_t *ws2811, int index)
 {
     ws2811_device_t *device = ws2811->device;
-    volatile dma_t *dma = device->dma;
     volatile pcm_t *pcm = device->pcm;
-    uint32_t dma_cb_addr = device->dma_cb_addr;
 
-    dma->cs = RPI_DMA_CS_RESET;
-    usleep(10);
-
-    dma->cs = RPI_DMA_CS_INT | RPI_DMA_CS_END;
-    usleep(10);
-
-    dma->conblk_ad = dma_cb_addr;
-    dma->debug = 7; // clear debug error flags
-    dma->cs = RPI_DMA_CS_WAIT_OUTSTANDING_WRITES |
-              RPI_DMA_CS_PANIC_PRIORITY(15) |
-              RPI_DMA_CS_PRIORITY(15) |
-              RPI_DMA_CS_ACTIVE;
+    dma_start_chain(device->dma, device->dma_cb_addr[index]);
 
     if (device->driver_mode == PCM)
     {
@@ -568,26 +638,19 @@ static int gpio_init(ws2811_t *ws2811)
  * multiple.
  *
  * @param    ws2811  ws2811 instance pointer.
+ * @param    index   Index of the pxl_raw buffer to initialize.
  *
  * @returns  None
  */
-void pwm_raw_init(ws2811_t *ws2811)
+void pwm_raw_init(ws2811_t *ws2811, int index)
 {
-    volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw;
-    int maxcount = ws2811->device->max_count;
-    int wordcount = (PWM_BYTE_COUNT(maxcount, ws2811->freq) / sizeof(uint32_t)) /
-                    RPI_PWM_CHANNELS;
-    int chan;
+    volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw[index];
+    int wordcount = ws2811->device->pxl_len / sizeof(uint32_t);
+    int i;
 
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    for (i = 0; i < wordcount; i++)
     {
-        int i, wordpos = chan;
-
-        for (i = 0; i < wordcount; i++)
-        {
-            pxl_raw[wordpos] = 0x0;
-            wordpos += 2;
-        }
+        pxl_raw[i] = 0x0;
     }
 }
 
@@ -596,14 +659,14 @@ void pwm_raw_init(ws2811_t *ws2811)
  * The DMA buffer length is assumed to be a word multiple.
  *
  * @param    ws2811  ws2811 instance pointer.
+ * @param    index   Index of the pxl_raw buffer to initialize.
  *
  * @returns  None
  */
-void pcm_raw_init(ws2811_t *ws2811)
+void pcm_raw_init(ws2811_t *ws2811, int index)
 {
-    volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw;
-    int maxcount = ws2811->device->max_count;
-    int wordcount = PCM_BYTE_COUNT(maxcount, ws2811->freq) / sizeof(uint32_t);
+    volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw[index];
+    int wordcount = ws2811->device->pxl_len / sizeof(uint32_t);
     int i;
 
     for (i = 0; i < wordcount; i++)
@@ -622,7 +685,7 @@ void pcm_raw_init(ws2811_t *ws2811)
 void ws2811_cleanup(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
-    int chan;
+    int chan, i;
 
     for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
@@ -636,18 +699,54 @@ void ws2811_cleanup(ws2811_t *ws2811)
             free(ws2811->channel[chan].gamma);
         }
         ws2811->channel[chan].gamma = NULL;
+        if (ws2811->channel[chan].color_lut)
+        {
+            free(ws2811->channel[chan].color_lut);
+        }
+        ws2811->channel[chan].color_lut = NULL;
+    }
+
+    if (device->color_bytes)
+    {
+        free(device->color_bytes);
+        device->color_bytes = NULL;
     }
 
-    if (device->mbox.handle != -1)
+    if (device->jobs)
     {
-        videocore_mbox_t *mbox = &device->mbox;
+        free(device->jobs);
+        device->jobs = NULL;
+    }
+
+    ws2811_workers_destroy(device->workers);
+    device->workers = NULL;
 
-        unmapmem(mbox->virt_addr, mbox->size);
-        mem_unlock(mbox->handle, mbox->mem_ref);
-        mem_free(mbox->handle, mbox->mem_ref);
-        mbox_close(mbox->handle);
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        for (i = 0; i < PXL_RAW_COUNT; i++)
+        {
+            if (device->shadow_leds[i][chan])
+            {
+                free(device->shadow_leds[i][chan]);
+            }
+            device->shadow_leds[i][chan] = NULL;
+        }
+        if (device->sent_leds[chan])
+        {
+            free(device->sent_leds[chan]);
+        }
+        device->sent_leds[chan] = NULL;
+    }
 
-        mbox->handle = -1;
+    if (device->simulated)
+    {
+        free(device->mbox.virt_addr);
+        device->mbox.virt_addr = NULL;
+        sim_close(device->sim_fd);
+    }
+    else
+    {
+        mbox_free(&device->mbox);
     }
 
     if (device && (device->spi_fd > 0))
@@ -655,6 +754,15 @@ void ws2811_cleanup(ws2811_t *ws2811)
         close(device->spi_fd);
     }
 
+    if (device && (device->driver_mode == SPI) && !device->simulated)
+    {
+        for (i = 0; i < PXL_RAW_COUNT; i++)
+        {
+            free((uint8_t *)device->pxl_raw[i]);
+            device->pxl_raw[i] = NULL;
+        }
+    }
+
     if (device) {
         free(device);
     }
@@ -749,15 +857,209 @@ static int check_hwver_and_gpionum(ws2811_t *ws2811)
     return -1;
 }
 
+/**
+ * Send one buffer over SPI as a single message.  ws2811_init makes sure a frame fits into the
+ * bufsiz of spidev, as a gap between two messages could be long enough to latch the strip.
+ *
+ * @param    device  Device with the SPI file descriptor.
+ * @param    index   Index of the pxl_raw buffer to send.
+ * @param    len     Bytes to send.
+ *
+ * @returns  0 on success, error code otherwise.
+ */
+static ws2811_return_t spi_transfer(ws2811_device_t *device, int index, uint32_t len)
+{
+    int ret;
+    struct spi_ioc_transfer tr;
+
+    memset(&tr, 0, sizeof(struct spi_ioc_transfer));
+    tr.tx_buf = (unsigned long)device->pxl_raw[index];
+    tr.rx_buf = 0;
+    tr.len = len;
+
+    ret = ioctl(device->spi_fd, SPI_IOC_MESSAGE(1), &tr);
+    if (ret < 1)
+    {
+        fprintf(stderr, "Can't send spi message");
+        return WS2811_ERROR_SPI_TRANSFER;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Read the largest message spidev accepts.
+ *
+ * @returns  bufsiz of the spidev module, SPI_BUFSIZ_DEFAULT if it can't be read.
+ */
+static uint32_t spi_bufsiz(void)
+{
+    FILE *file = fopen(SPI_BUFSIZ_PATH, "r");
+    unsigned int bufsiz = 0;
+
+    if (file)
+    {
+        if (fscanf(file, "%u", &bufsiz) != 1)
+        {
+            bufsiz = 0;
+        }
+        fclose(file);
+    }
+
+    return bufsiz ? bufsiz : SPI_BUFSIZ_DEFAULT;
+}
+
+static void *spi_thread_main(void *arg)
+{
+    ws2811_device_t *device = arg;
+
+    pthread_mutex_lock(&device->spi_lock);
+    while (1)
+    {
+        while (!device->spi_shutdown && (device->spi_queued < 0))
+        {
+            pthread_cond_wait(&device->spi_queue_cond, &device->spi_lock);
+        }
+        if (device->spi_shutdown)
+        {
+            break;
+        }
+
+        const int index = device->spi_queued;
+        const uint32_t len = device->spi_len[index];
+        device->spi_queued = -1;
+        pthread_mutex_unlock(&device->spi_lock);
+
+        const ws2811_return_t result = spi_transfer(device, index, len);
+
+        pthread_mutex_lock(&device->spi_lock);
+        device->spi_result = result;
+        __atomic_store_n(&device->spi_busy, 0, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&device->spi_done_cond);
+    }
+    pthread_mutex_unlock(&device->spi_lock);
+
+    return NULL;
+}
+
+/**
+ * Start the thread that sends queued frames over SPI.
+ *
+ * @param    device  Device with the SPI buffers.
+ *
+ * @returns  0 on success, -1 if the thread could not be started.
+ */
+static int spi_thread_start(ws2811_device_t *device)
+{
+    pthread_mutex_init(&device->spi_lock, NULL);
+    pthread_cond_init(&device->spi_queue_cond, NULL);
+    pthread_cond_init(&device->spi_done_cond, NULL);
+    device->spi_queued = -1;
+    device->spi_busy = 0;
+    device->spi_shutdown = 0;
+    device->spi_result = WS2811_SUCCESS;
+
+    if (pthread_create(&device->spi_thread, NULL, spi_thread_main, device))
+    {
+        pthread_cond_destroy(&device->spi_done_cond);
+        pthread_cond_destroy(&device->spi_queue_cond);
+        pthread_mutex_destroy(&device->spi_lock);
+        return -1;
+    }
+    device->spi_thread_started = 1;
+
+    return 0;
+}
+
+/**
+ * Let the SPI thread finish the frame it is sending and stop it.  Does nothing if it was
+ * never started.
+ *
+ * @param    device  Device with the SPI thread.
+ *
+ * @returns  None
+ */
+static void spi_thread_stop(ws2811_device_t *device)
+{
+    if (!device->spi_thread_started)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&device->spi_lock);
+    device->spi_shutdown = 1;
+    pthread_cond_signal(&device->spi_queue_cond);
+    pthread_mutex_unlock(&device->spi_lock);
+
+    pthread_join(device->spi_thread, NULL);
+    pthread_cond_destroy(&device->spi_done_cond);
+    pthread_cond_destroy(&device->spi_queue_cond);
+    pthread_mutex_destroy(&device->spi_lock);
+    device->spi_thread_started = 0;
+}
+
+/**
+ * Hand a rendered buffer to the SPI thread.  The previous frame must have been sent.
+ *
+ * @param    device  Device with the SPI thread.
+ * @param    index   Index of the pxl_raw buffer to send.
+ * @param    len     Bytes to send.
+ *
+ * @returns  None
+ */
+static void spi_queue(ws2811_device_t *device, int index, uint32_t len)
+{
+    pthread_mutex_lock(&device->spi_lock);
+    device->spi_len[index] = len;
+    device->spi_queued = index;
+    __atomic_store_n(&device->spi_busy, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&device->spi_queue_cond);
+    pthread_mutex_unlock(&device->spi_lock);
+}
+
+/**
+ * Wait for the frame handed to the SPI thread to be sent.
+ *
+ * @param    device  Device with the SPI thread.
+ *
+ * @returns  Result of the transfer.
+ */
+static ws2811_return_t spi_wait(ws2811_device_t *device)
+{
+    ws2811_return_t result;
+
+    pthread_mutex_lock(&device->spi_lock);
+    while (device->spi_busy)
+    {
+        pthread_cond_wait(&device->spi_done_cond, &device->spi_lock);
+    }
+    result = device->spi_result;
+    device->spi_result = WS2811_SUCCESS;
+    pthread_mutex_unlock(&device->spi_lock);
+
+    return result;
+}
+
 static ws2811_return_t spi_init(ws2811_t *ws2811)
 {
     int spi_fd;
     static uint8_t mode;
     static uint8_t bits = 8;
-    uint32_t speed = ws2811->freq * 3;
+    uint32_t speed = SYMBOL_FREQ(&ws2811->device->timing);
     ws2811_device_t *device = ws2811->device;
     uint32_t base = ws2811->rpi_hw->periph_base;
     int pinnum = ws2811->channel[0].gpionum;
+    const uint32_t bufsiz = spi_bufsiz();
+    int i;
+
+    // spidev sends at most bufsiz bytes in one message, the whole frame has to fit
+    if (device->pxl_len > bufsiz)
+    {
+        fprintf(stderr, "SPI frame of %u bytes exceeds the spidev bufsiz of %u, raise spidev.bufsiz\n",
+                device->pxl_len, bufsiz);
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_SPI_SETUP;
+    }
 
     spi_fd = open("/dev/spidev0.0", O_RDWR);
     if (spi_fd < 0) {
@@ -798,12 +1100,15 @@ static ws2811_return_t spi_init(ws2811_t *ws2811)
 
     // Initialize device structure elements to not used
     // except driver_mode, spi_fd and max_count (already defined when spi_init called)
-    device->pxl_raw = NULL;
+    device->pxl_raw[0] = NULL;
+    device->pxl_raw[1] = NULL;
     device->dma = NULL;
     device->pwm = NULL;
     device->pcm = NULL;
-    device->dma_cb = NULL;
-    device->dma_cb_addr = 0;
+    device->dma_cb[0] = NULL;
+    device->dma_cb[1] = NULL;
+    device->dma_cb_addr[0] = 0;
+    device->dma_cb_addr[1] = 0;
     device->cm_clk = NULL;
     device->mbox.handle = -1;
 
@@ -839,38 +1144,110 @@ static ws2811_return_t spi_init(ws2811_t *ws2811)
       }
     }
 
+    channel->color_lut = malloc(sizeof(uint8_t) * 256);
+    if (!channel->color_lut)
+    {
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    ws2811_update_color_lut(ws2811, 0);
+
     channel->wshift = (channel->strip_type >> 24) & 0xff;
     channel->rshift = (channel->strip_type >> 16) & 0xff;
     channel->gshift = (channel->strip_type >> 8)  & 0xff;
     channel->bshift = (channel->strip_type >> 0)  & 0xff;
 
-    // Allocate SPI transmit buffer (same size as PCM)
-    device->pxl_raw = malloc(PCM_BYTE_COUNT(device->max_count, ws2811->freq));
-    if (device->pxl_raw == NULL)
+    // Allocate SPI transmit buffers of pxl_len, the same size as PCM.  Like for DMA the frame
+    // is encoded into one transmit buffer while the other may still be sent.
+    for (i = 0; i < PXL_RAW_COUNT; i++)
+    {
+        device->pxl_raw[i] = malloc(device->pxl_len);
+        if (device->pxl_raw[i] == NULL)
+        {
+            ws2811_cleanup(ws2811);
+            return WS2811_ERROR_OUT_OF_MEMORY;
+        }
+        pcm_raw_init(ws2811, i);
+    }
+
+    if (spi_thread_start(device) < 0)
     {
         ws2811_cleanup(ws2811);
-        return WS2811_ERROR_OUT_OF_MEMORY;
+        return WS2811_ERROR_SPI_SETUP;
     }
-    pcm_raw_init(ws2811);
 
     return WS2811_SUCCESS;
 }
 
-static ws2811_return_t spi_transfer(ws2811_t *ws2811)
-{
-    int ret;
-    struct spi_ioc_transfer tr;
 
-    memset(&tr, 0, sizeof(struct spi_ioc_transfer));
-    tr.tx_buf = (unsigned long)ws2811->device->pxl_raw;
-    tr.rx_buf = 0;
-    tr.len = PCM_BYTE_COUNT(ws2811->device->max_count, ws2811->freq);
+/**
+ * Stand in for mbox_alloc when running without hardware.  The control blocks and buffers go to
+ * ordinary memory and a file named by the WS2811_SIMULATE value is opened for the frames,
+ * except for "1" or an empty value.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    path    Value of WS2811_SIMULATE.
+ *
+ * @returns  0 on success, error code otherwise.
+ */
+static ws2811_return_t sim_init(ws2811_t *ws2811, const char *path)
+{
+    ws2811_device_t *device = ws2811->device;
 
-    ret = ioctl(ws2811->device->spi_fd, SPI_IOC_MESSAGE(1), &tr);
-    if (ret < 1)
+    device->mbox.handle = -1;
+    device->mbox.virt_addr = calloc(1, device->mbox.size);
+    if (!device->mbox.virt_addr)
     {
-        fprintf(stderr, "Can't send spi message");
-        return WS2811_ERROR_SPI_TRANSFER;
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    if (*path && strcmp(path, "1"))
+    {
+        device->sim_fd = sim_open(path);
+        device->sim_gpionum = ws2811->channel[0].count ? ws2811->channel[0].gpionum : ws2811->channel[1].gpionum;
+        if (device->sim_fd < 0)
+        {
+            fprintf(stderr, "Cannot open %s for the simulated frames\n", path);
+            return WS2811_ERROR_GENERIC;
+        }
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * "Send" a frame of a simulated driver by writing it to its file, if it has one, behind a
+ * ws2811_sim_header_t.  Completion is faked by ws2811_wait sleeping through the wire time.
+ *
+ * @param    device  Device of a simulated driver.
+ * @param    index   Index of the pxl_raw buffer to send.
+ *
+ * @returns  0 on success, error code otherwise.
+ */
+static ws2811_return_t sim_send(ws2811_device_t *device, int index)
+{
+    ws2811_sim_header_t header;
+    struct iovec iov[2];
+
+    if (device->sim_fd < 0)
+    {
+        return WS2811_SUCCESS;
+    }
+
+    header.magic = WS2811_SIM_MAGIC;
+    header.layout = (device->driver_mode == SPI) ? WS2811_LAYOUT_SPI :
+                    (device->pwm_channels > 1) ? WS2811_LAYOUT_PWM : WS2811_LAYOUT_PCM;
+    header.symbols = device->timing.symbols;
+    header.len = device->tx_len;
+    header.gpionum = device->sim_gpionum;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)device->pxl_raw[index];
+    iov[1].iov_len = device->tx_len;
+    if (writev(device->sim_fd, iov, 2) != (ssize_t)(sizeof(header) + device->tx_len))
+    {
+        return WS2811_ERROR_GENERIC;
     }
 
     return WS2811_SUCCESS;
@@ -887,6 +1264,9 @@ static ws2811_return_t spi_transfer(ws2811_t *ws2811)
 /**
  * Allocate and initialize memory, buffers, pages, PWM, DMA, and GPIO.
  *
+ * With WS2811_SIMULATE set in the environment no hardware is touched.  The driver acts as on
+ * a Pi 3 with the mode the GPIOs select, encodes every frame as usual and fakes the wire time.
+ *
  * @param    ws2811  ws2811 instance pointer.
  *
  * @returns  0 on success, -1 otherwise.
@@ -894,15 +1274,14 @@ static ws2811_return_t spi_transfer(ws2811_t *ws2811)
 ws2811_return_t ws2811_init(ws2811_t *ws2811)
 {
     ws2811_device_t *device;
-    const rpi_hw_t *rpi_hw;
-    int chan;
+    const char *simulate = getenv(WS2811_SIMULATE_ENV);
+    int chan, i;
 
-    ws2811->rpi_hw = rpi_hw_detect();
+    ws2811->rpi_hw = simulate ? &simulated_hw : rpi_hw_detect();
     if (!ws2811->rpi_hw)
     {
         return WS2811_ERROR_HW_NOT_SUPPORTED;
     }
-    rpi_hw = ws2811->rpi_hw;
 
     ws2811->device = malloc(sizeof(*ws2811->device));
     if (!ws2811->device)
@@ -911,69 +1290,161 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811)
     }
     memset(ws2811->device, 0, sizeof(*ws2811->device));
     device = ws2811->device;
+    device->simulated = (simulate != NULL);
+    device->sim_fd = -1;
+    device->mbox.handle = -1;
+
+    // Initialize all pointers to NULL.  Any non-NULL pointers will be freed on cleanup,
+    // which every error return below goes through.
+    for (i = 0; i < PXL_RAW_COUNT; i++)
+    {
+        device->pxl_raw[i] = NULL;
+        device->dma_cb[i] = NULL;
+    }
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811->channel[chan].leds = NULL;
+        ws2811->channel[chan].color_lut = NULL;
+    }
 
     if (check_hwver_and_gpionum(ws2811) < 0)
     {
+        ws2811_cleanup(ws2811);
         return WS2811_ERROR_ILLEGAL_GPIO;
     }
 
     device->max_count = max_channel_led_count(ws2811);
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        device->init_count[chan] = ws2811->channel[chan].count;
+    }
+    device->max_color_bytes = max_channel_color_bytes(ws2811);
 
-    if (device->driver_mode == SPI) {
-        return spi_init(ws2811);
+    // Both PWM channels share the FIFO only when both drive LEDs, a single one gets every word
+    device->pwm_channels = 1;
+    if ((device->driver_mode == PWM) && ws2811->channel[0].count && ws2811->channel[1].count)
+    {
+        device->pwm_channels = RPI_PWM_CHANNELS;
     }
 
-    // Determine how much physical memory we need for DMA
-    switch (device->driver_mode) {
-    case PWM:
-        device->mbox.size = PWM_BYTE_COUNT(device->max_count, ws2811->freq) +
-                            sizeof(dma_cb_t);
-        break;
+    const ws2811_timing_t *timing = ws2811_get_timing(ws2811->timing);
+    if (!timing)
+    {
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_TIMING;
+    }
+    device->timing = *timing;
+    if (!device->timing.freq)
+    {
+        device->timing.freq = ws2811->freq;
+    }
+    device->byte_bits = 8 * device->timing.symbols;
 
-    case PCM:
-        device->mbox.size = PCM_BYTE_COUNT(device->max_count, ws2811->freq) +
-                            sizeof(dma_cb_t);
-        break;
+    symbol_lut_init(device->symbol_lut, &device->timing);
+
+    // Inversion is handled by hardware for PWM, otherwise by software in the encoder
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+        int layout = WS2811_LAYOUT_PWM;
+
+        if (device->driver_mode == SPI)
+        {
+            layout = WS2811_LAYOUT_SPI;
+        }
+        else if ((device->driver_mode == PCM) || (device->pwm_channels == 1))
+        {
+            layout = WS2811_LAYOUT_PCM;
+        }
+
+        const int invert = (device->driver_mode != PWM) && channel->invert;
+
+        // The vector encoder only knows the WS2812B symbols
+        if ((device->timing.symbols == 3) && (device->timing.symbol_high == SYMBOL_HIGH) &&
+            (device->timing.symbol_low == SYMBOL_LOW))
+        {
+            device->encoder[chan] = ws2811_encoder_select(layout, invert);
+        }
+        else
+        {
+            device->encoder[chan] = ws2811_encoder_select_scalar(layout, invert, device->timing.symbols);
+        }
     }
-    // Round up to page size multiple
-    device->mbox.size = (device->mbox.size + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
 
-    device->mbox.handle = mbox_open();
-    if (device->mbox.handle == -1)
+    // Multi-core boards encode long frames on several threads, single core ones have none.  The
+    // threads are only started once a frame is long enough to need them.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    device->worker_count = (cpus - 1 < ENCODE_MAX_WORKERS) ? cpus - 1 : ENCODE_MAX_WORKERS;
+    if (device->worker_count < 0)
     {
-        return WS2811_ERROR_MAILBOX_DEVICE;
+        device->worker_count = 0;
     }
 
-    device->mbox.mem_ref = mem_alloc(device->mbox.handle, device->mbox.size, PAGE_SIZE,
-                                     rpi_hw->videocore_base == 0x40000000 ? 0xC : 0x4);
-    if (device->mbox.mem_ref == 0)
+    // Room for the color bytes of the longest channel for each thread
+    device->color_bytes_len = (device->max_color_bytes + WS2811_PRESTAGE_SLACK + 63) & ~63;
+    device->color_bytes = malloc(device->color_bytes_len * (1 + device->worker_count));
+    device->jobs = malloc(sizeof(encode_job_t) * RPI_PWM_CHANNELS * ENCODE_JOB_COUNT(device->max_count));
+    if (!device->color_bytes || !device->jobs)
     {
+        ws2811_cleanup(ws2811);
         return WS2811_ERROR_OUT_OF_MEMORY;
     }
 
-    device->mbox.bus_addr = mem_lock(device->mbox.handle, device->mbox.mem_ref);
-    if (device->mbox.bus_addr == (uint32_t) ~0UL)
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
-       mem_free(device->mbox.handle, device->mbox.size);
-       return WS2811_ERROR_MEM_LOCK;
+        if (ws2811->channel[chan].count)
+        {
+            for (i = 0; i < PXL_RAW_COUNT; i++)
+            {
+                device->shadow_leds[i][chan] = malloc(sizeof(ws2811_led_t) * ws2811->channel[chan].count);
+                if (!device->shadow_leds[i][chan])
+                {
+                    ws2811_cleanup(ws2811);
+                    return WS2811_ERROR_OUT_OF_MEMORY;
+                }
+            }
+            device->sent_leds[chan] = malloc(sizeof(ws2811_led_t) * ws2811->channel[chan].count);
+            if (!device->sent_leds[chan])
+            {
+                ws2811_cleanup(ws2811);
+                return WS2811_ERROR_OUT_OF_MEMORY;
+            }
+        }
     }
 
-    device->mbox.virt_addr = mapmem(BUS_TO_PHYS(device->mbox.bus_addr), device->mbox.size, DEV_MEM);
-    if (!device->mbox.virt_addr)
-    {
-        mem_unlock(device->mbox.handle, device->mbox.mem_ref);
-        mem_free(device->mbox.handle, device->mbox.size);
+    // Determine how much physical memory we need for DMA
+    switch (device->driver_mode) {
+    case PWM:
+        // Channel 1 starts on the bit channel 0 ended on, so it may need one more word
+        device->pxl_len = PWM_BYTE_COUNT(device->max_color_bytes + ((device->pwm_channels > 1) ? 4 : 0),
+                                         &device->timing, device->pwm_channels);
+        break;
 
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_MMAP;
+    case PCM:
+    case SPI:
+        device->pxl_len = PCM_BYTE_COUNT(device->max_color_bytes, &device->timing);
+        break;
     }
 
-    // Initialize all pointers to NULL.  Any non-NULL pointers will be freed on cleanup.
-    device->pxl_raw = NULL;
-    device->dma_cb = NULL;
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    // Interleaved PWM channels are sent in parallel, wire_time_ns is valid for every output
+    device->wire_time_ns = ((uint64_t)device->pxl_len * 8 * 1000000000) /
+                           (device->pwm_channels * SYMBOL_FREQ(&device->timing));
+
+    if ((device->driver_mode == SPI) && !device->simulated) {
+        return spi_init(ws2811);
+    }
+
+    device->mbox.size = (device->pxl_len + sizeof(dma_cb_t)) * PXL_RAW_COUNT;
+    // Round up to page size multiple
+    device->mbox.size = (device->mbox.size + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+
+    // A simulated driver uses ordinary memory in place of the mailbox and sends nothing
+    ws2811_return_t ret = device->simulated ? sim_init(ws2811, simulate) :
+                                                mbox_alloc(&device->mbox, ws2811->rpi_hw);
+    if (ret != WS2811_SUCCESS)
     {
-        ws2811->channel[chan].leds = NULL;
+        ws2811_cleanup(ws2811);
+        return ret;
     }
 
     // Allocate the LED buffers
@@ -1005,6 +1476,14 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811)
           }
         }
 
+        channel->color_lut = malloc(sizeof(uint8_t) * 256);
+        if (!channel->color_lut)
+        {
+            ws2811_cleanup(ws2811);
+            return WS2811_ERROR_OUT_OF_MEMORY;
+        }
+        ws2811_update_color_lut(ws2811, chan);
+
         channel->wshift = (channel->strip_type >> 24) & 0xff;
         channel->rshift = (channel->strip_type >> 16) & 0xff;
         channel->gshift = (channel->strip_type >> 8)  & 0xff;
@@ -1012,23 +1491,38 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811)
 
     }
 
-    device->dma_cb = (dma_cb_t *)device->mbox.virt_addr;
-    device->pxl_raw = (uint8_t *)device->mbox.virt_addr + sizeof(dma_cb_t);
+    // Control blocks first to keep their alignment, followed by the buffers
+    for (i = 0; i < PXL_RAW_COUNT; i++)
+    {
+        device->dma_cb[i] = (dma_cb_t *)device->mbox.virt_addr + i;
+        device->pxl_raw[i] = (uint8_t *)device->mbox.virt_addr + (sizeof(dma_cb_t) * PXL_RAW_COUNT) +
+                             (device->pxl_len * i);
+    }
+    device->pxl_next = 0;
 
-    switch (device->driver_mode) {
-    case PWM:
-       pwm_raw_init(ws2811);
-       break;
+    for (i = 0; i < PXL_RAW_COUNT; i++)
+    {
+        switch (device->driver_mode) {
+        case PWM:
+           pwm_raw_init(ws2811, i);
+           break;
+
+        case PCM:
+        case SPI:
+           pcm_raw_init(ws2811, i);
+           break;
+        }
 
-    case PCM:
-       pcm_raw_init(ws2811);
-       break;
-    }
+        memset((dma_cb_t *)device->dma_cb[i], 0, sizeof(dma_cb_t));
 
-    memset((dma_cb_t *)device->dma_cb, 0, sizeof(dma_cb_t));
+        // Cache the DMA control block bus address
+        device->dma_cb_addr[i] = addr_to_bus(&device->mbox, device->dma_cb[i]);
+    }
 
-    // Cache the DMA control block bus address
-    device->dma_cb_addr = addr_to_bus(device, device->dma_cb);
+    if (device->simulated)
+    {
+        return WS2811_SUCCESS;
+    }
 
     // Map the physical registers into userspace
     if (map_registers(ws2811))
@@ -1081,14 +1575,17 @@ void ws2811_fini(ws2811_t *ws2811)
     volatile pcm_t *pcm = ws2811->device->pcm;
 
     ws2811_wait(ws2811);
-    switch (ws2811->device->driver_mode) {
+    switch (ws2811->device->simulated ? NONE : ws2811->device->driver_mode) {
     case PWM:
-        stop_pwm(ws2811);
+        pwm_stop(ws2811->device->pwm, ws2811->device->cm_clk);
         break;
     case PCM:
         while (!(pcm->cs & RPI_PCM_CS_TXE)) ;    // Wait till TX FIFO is empty
         stop_pcm(ws2811);
         break;
+    case SPI:
+        spi_thread_stop(ws2811->device);
+        break;
     }
 
     unmap_registers(ws2811);
@@ -1105,26 +1602,18 @@ void ws2811_fini(ws2811_t *ws2811)
  */
 ws2811_return_t ws2811_wait(ws2811_t *ws2811)
 {
-    volatile dma_t *dma = ws2811->device->dma;
-
-    if (ws2811->device->driver_mode == SPI)  // Nothing to do for SPI
+    if (ws2811->device->simulated)  // Nothing is sent, the frame takes as long as it would
     {
+        sleep_until(ws2811->device->dma_deadline_ns);
         return WS2811_SUCCESS;
     }
 
-    while ((dma->cs & RPI_DMA_CS_ACTIVE) &&
-           !(dma->cs & RPI_DMA_CS_ERROR))
+    if (ws2811->device->driver_mode == SPI)  // The SPI thread sends the frame
     {
-        usleep(10);
+        return spi_wait(ws2811->device);
     }
 
-    if (dma->cs & RPI_DMA_CS_ERROR)
-    {
-        fprintf(stderr, "DMA Error: %08x\n", dma->debug);
-        return WS2811_ERROR_DMA;
-    }
-
-    return WS2811_SUCCESS;
+    return dma_wait(ws2811->device->dma, ws2811->device->dma_deadline_ns);
 }
 
 /**
@@ -1137,107 +1626,444 @@ ws2811_return_t ws2811_wait(ws2811_t *ws2811)
  */
 ws2811_return_t ws2811_render(ws2811_t *ws2811)
 {
-    volatile uint8_t *pxl_raw = ws2811->device->pxl_raw;
-    int driver_mode = ws2811->device->driver_mode;
-    int bitpos;
-    int i, k, l, chan;
-    unsigned j;
+    return ws2811_render_async(ws2811, NULL);
+}
+
+/**
+ * First LED at or after a given one whose symbols start on a word boundary.
+ *
+ * @param    carry_bits  Bits of the first word of the channel used by the previous channel.
+ * @param    led_bits    Bits on the wire per LED.
+ * @param    led         LED to start searching from.
+ *
+ * @returns  LED index, -1 if no LED of the channel starts on a word boundary.
+ */
+static int next_word_aligned_led(int carry_bits, int led_bits, int led)
+{
+    int i;
+
+    // the bit offset of an LED repeats its alignment every 4 LEDs
+    for (i = led; i < led + 4; i++)
+    {
+        if (((carry_bits + (i * led_bits)) % 32) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Queue a run of LEDs for encoding, split into word aligned chunks when it is long enough to
+ * be worth spreading over the worker threads.  Chunks never share a word, so they can be
+ * encoded at the same time.
+ *
+ * @param    device      Device to add the jobs to.
+ * @param    chan        Channel of the run.
+ * @param    words       First word of the channel in the pxl_raw buffer being filled.
+ * @param    carry_bits  Bits of the first word used by the previous channel.
+ * @param    led_bits    Bits on the wire per LED.
+ * @param    first       First LED of the run.
+ * @param    last        LED after the run.
+ *
+ * @returns  None
+ */
+static void add_encode_jobs(ws2811_device_t *device, int chan, uint32_t *words, int carry_bits, int led_bits,
+                            int first, int last)
+{
+    while (first < last)
+    {
+        encode_job_t *job = &device->jobs[device->job_count++];
+        int split = -1;
+
+        if (device->worker_count && ((last - first) >= (2 * ENCODE_CHUNK_LEDS)))
+        {
+            split = next_word_aligned_led(carry_bits, led_bits, first + ENCODE_CHUNK_LEDS);
+        }
+        if ((split < 0) || (split >= last))
+        {
+            split = last;
+        }
+
+        job->chan = chan;
+        job->first = first;
+        job->count = split - first;
+        job->words = words;
+        job->carry_bits = carry_bits;
+        device->job_leds += job->count;
+        first = split;
+    }
+}
+
+/**
+ * LED after the last one of a channel that differs from what the strip shows, all of them if
+ * that is not known.  The copy of the strip is brought up to date with the LEDs.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    chan    Channel to check.
+ *
+ * @returns  Number of LEDs up to and including the last changed one.
+ */
+static int count_changed_leds(ws2811_t *ws2811, int chan)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_channel_t *channel = &ws2811->channel[chan];
+    ws2811_led_t *sent = device->sent_leds[chan];
+    const ws2811_led_t *leds = channel->map ? channel->source : channel->leds;
+    const uint32_t *map = channel->map;
+    int end = 0;
+    int i;
+
+    for (i = 0; i < channel->count; i++)
+    {
+        const ws2811_led_t led = leds[map ? (int)map[i] : i];
+
+        if (led != sent[i])
+        {
+            sent[i] = led;
+            end = i + 1;
+        }
+    }
+
+    // Without a copy of the strip the LEDs past the last changed one may show anything
+    if (!device->sent_valid[chan])
+    {
+        end = channel->count;
+        device->sent_valid[chan] = 1;
+    }
+
+    return end;
+}
+
+/**
+ * Queue the runs of LEDs of a channel up to send_count that differ from the ones encoded in
+ * the pxl_raw buffer being filled, which holds the frame before the previous one.  The LEDs
+ * past the ones still encoded there are all queued.  Runs are joined across short stretches
+ * of unchanged LEDs, as every run costs a partial word at both ends.
+ *
+ * @param    ws2811      ws2811 instance pointer.
+ * @param    chan        Channel to encode.
+ * @param    words       First word of the channel in the pxl_raw buffer being filled.
+ * @param    carry_bits  Bits of the first word used by the previous channel.
+ * @param    send_count  LEDs of the channel that will be sent.
+ *
+ * @returns  None
+ */
+static void queue_changed_leds(ws2811_t *ws2811, int chan, uint32_t *words, int carry_bits, int send_count)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_channel_t *channel = &ws2811->channel[chan];
+    const int index = device->pxl_next;
+    ws2811_led_t *shadow = device->shadow_leds[index][chan];
+    const ws2811_led_t *leds = channel->map ? channel->source : channel->leds;
+    const uint32_t *map = channel->map;
+    const int led_bits = ws2811_strip_colors(channel) * device->byte_bits;
+    const int valid = (device->shadow_count[index][chan] < send_count) ? device->shadow_count[index][chan] :
+                                                                          send_count;
+    int first = 0;
+
+    while (first < send_count)
+    {
+        int unchanged = 0;
+        int last;
+
+        while ((first < valid) && (leds[map ? (int)map[first] : first] == shadow[first]))
+        {
+            first++;
+        }
+        if (first == send_count)
+        {
+            break;
+        }
+
+        for (last = first + 1; (last < send_count) && (unchanged < DIRTY_RUN_GAP); last++)
+        {
+            unchanged = ((last < valid) && (leds[map ? (int)map[last] : last] == shadow[last])) ? unchanged + 1 : 0;
+        }
+        last -= unchanged;
+
+        add_encode_jobs(device, chan, words, carry_bits, led_bits, first, last);
+        first = last;
+    }
+
+    // The bits past the LEDs being sent are cleared once the frame is encoded
+    device->shadow_count[index][chan] = send_count;
+}
+
+/**
+ * Forget what is encoded in the pxl_raw buffers and shown on the strip for a channel, so all
+ * of its LEDs are encoded and sent on the next render.
+ *
+ * @param    device  Device of the channel.
+ * @param    chan    Channel that changed.
+ *
+ * @returns  None
+ */
+static void invalidate_shadow(ws2811_device_t *device, int chan)
+{
+    int i;
+
+    for (i = 0; i < PXL_RAW_COUNT; i++)
+    {
+        device->shadow_count[i][chan] = 0;
+    }
+    device->sent_valid[chan] = 0;
+}
+
+/**
+ * Encode one queued run of LEDs and update the shadow copy of the buffer.  Each thread has its own part of
+ * color_bytes to prestage into.
+ *
+ * @param    arg     ws2811 instance pointer.
+ * @param    index   Index of the job.
+ * @param    thread  Index of the thread running the job.
+ *
+ * @returns  None
+ */
+static void run_encode_job(void *arg, int index, int thread)
+{
+    ws2811_t *ws2811 = arg;
+    ws2811_device_t *device = ws2811->device;
+    const encode_job_t *job = &device->jobs[index];
+    ws2811_channel_t *channel = &ws2811->channel[job->chan];
+    uint8_t *color_bytes = device->color_bytes + (thread * device->color_bytes_len);
+    const int colors = ws2811_strip_colors(channel);
+    const int word_step = device->pwm_channels;
+    const uint32_t bit_offset = job->carry_bits + (job->first * colors * device->byte_bits);
+
+    ws2811_prestage(channel, job->first, job->count, color_bytes);
+    device->encoder[job->chan](color_bytes, job->count * colors, device->symbol_lut,
+                               job->words + ((bit_offset / 32) * word_step), bit_offset % 32);
+    ws2811_led_t *shadow = &device->shadow_leds[device->pxl_next][job->chan][job->first];
+
+    if (channel->map)
+    {
+        const uint32_t *map = &channel->map[job->first];
+        int i;
+
+        for (i = 0; i < job->count; i++)
+        {
+            shadow[i] = channel->source[map[i]];
+        }
+    }
+    else
+    {
+        memcpy(shadow, &channel->leds[job->first], sizeof(ws2811_led_t) * job->count);
+    }
+}
+
+/**
+ * Encode all queued runs, spread over the worker threads if there is enough to encode.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void run_encode_jobs(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int i;
+
+    if (device->worker_count && !device->workers && (device->job_leds >= PARALLEL_ENCODE_MIN_LEDS))
+    {
+        device->workers = ws2811_workers_create(device->worker_count);
+        if (!device->workers)
+        {
+            device->worker_count = 0;
+        }
+    }
+
+    if (device->workers && (device->job_count > 1) && (device->job_leds >= PARALLEL_ENCODE_MIN_LEDS))
+    {
+        ws2811_workers_run(device->workers, run_encode_job, ws2811, device->job_count);
+    }
+    else
+    {
+        for (i = 0; i < device->job_count; i++)
+        {
+            run_encode_job(ws2811, i, 0);
+        }
+    }
+
+    device->job_count = 0;
+    device->job_leds = 0;
+}
+
+/**
+ * Clear the bits of a channel in a DMA buffer that are not part of the LEDs being sent, the
+ * ones before its first LED and the ones from its last LED up to data_len.  There the buffer
+ * can still hold LEDs of an earlier frame past a truncated one, rounded up to whole words, or
+ * LEDs dropped by ws2811_set_count.
+ *
+ * @param    device     Device with the pxl_raw buffer.
+ * @param    index      Index of the pxl_raw buffer.
+ * @param    chan       Channel, selects its words when both PWM channels are used.
+ * @param    start_bit  Bit of the first word the channel starts on.
+ * @param    end_bit    Bit after the last LED being sent.
+ * @param    data_len   Bytes of the buffer holding LED data.
+ *
+ * @returns  None
+ */
+static void clear_unsent_bits(ws2811_device_t *device, int index, int chan, uint32_t start_bit, uint32_t end_bit,
+                              uint32_t data_len)
+{
+    uint32_t i;
+
+    if (device->driver_mode == SPI)
+    {
+        volatile uint8_t *bytes = device->pxl_raw[index];
+
+        i = end_bit / 8;
+        if ((end_bit % 8) && (i < data_len))
+        {
+            bytes[i++] &= 0xff << (8 - (end_bit % 8));
+        }
+        for (; i < data_len; i++)
+        {
+            bytes[i] = 0;
+        }
+        return;
+    }
+
+    const int word_step = device->pwm_channels;
+    volatile uint32_t *words = (volatile uint32_t *)device->pxl_raw[index] + ((word_step > 1) ? chan : 0);
+    const uint32_t word_count = data_len / (4 * word_step);
+
+    // Words are sent MSB first, start_bit is below 32 as it is the carry of the previous channel
+    if (start_bit && word_count)
+    {
+        words[0] &= ~0u >> start_bit;
+    }
+
+    i = end_bit / 32;
+    if ((end_bit % 32) && (i < word_count))
+    {
+        words[i * word_step] &= ~0u << (32 - (end_bit % 32));
+        i++;
+    }
+    for (; i < word_count; i++)
+    {
+        words[i * word_step] = 0;
+    }
+}
+
+/**
+ * Render the DMA buffer from the user supplied LED arrays and start the DMA controller
+ * without waiting for the frame to be sent.  Only a previous frame still on the wire is
+ * waited for.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    fence   Set to the fence of this frame for ws2811_fence_poll and
+ *                   ws2811_fence_wait, may be NULL.
+ *
+ * @returns  0 on success, error code otherwise.
+ */
+ws2811_return_t ws2811_render_async(ws2811_t *ws2811, ws2811_fence_t *fence)
+{
+    ws2811_device_t *device = ws2811->device;
+    // The DMA or the SPI thread is at most sending the other buffer, so the next one can be
+    // filled while the previous frame is still on the wire.
+    uint8_t *pxl_raw = (uint8_t *)device->pxl_raw[device->pxl_next];
+    int driver_mode = device->driver_mode;
+    int chan;
+    uint32_t i;
     ws2811_return_t ret = WS2811_SUCCESS;
     uint32_t protocol_time = 0;
-    static uint64_t previous_timestamp = 0;
-
-    bitpos = (driver_mode == SPI ? 7 : 31);
+    uint32_t sent_words = 0;
+    uint32_t start_bits[RPI_PWM_CHANNELS], end_bits[RPI_PWM_CHANNELS];
+    int carry_bits = 0;
+    int shrunk = 0;
 
     for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)         // Channel
     {
         ws2811_channel_t *channel = &ws2811->channel[chan];
+        // Every other word is on the same channel when both PWM channels are used
+        uint32_t *words = (uint32_t *)pxl_raw + ((device->pwm_channels > 1) ? chan : 0);
+        // If our shift mask includes the highest nibble, then we have 4 LEDs, RBGW.
+        const int array_size = ws2811_strip_colors(channel);
 
-        int wordpos = chan; // PWM & PCM
-        int bytepos = 0;    // SPI
-        const int scale = (channel->brightness & 0xff) + 1;
-        uint8_t array_size = 3; // Assume 3 color LEDs, RGB
+        // Brightness or the gamma table changed since the last frame
+        if ((channel->brightness != device->color_lut_brightness[chan]) ||
+            (channel->gamma != device->color_lut_gamma[chan]))
+        {
+            ws2811_update_color_lut(ws2811, chan);
+        }
 
-        // If our shift mask includes the highest nibble, then we have 4 LEDs, RBGW.
-        if (channel->strip_type & SK6812_SHIFT_WMASK)
+        // The LEDs past the last changed one already show their colors
+        int send_count = channel->count;
+        if (ws2811->render_truncate)
+        {
+            send_count = count_changed_leds(ws2811, chan);
+        }
+        else
         {
-            array_size = 4;
+            device->sent_valid[chan] = 0;
         }
 
-        // 1.25µs per bit
-        const uint32_t channel_protocol_time = channel->count * array_size * 8 * 1.25;
+        // A channel starts at the bit position the previous channel ended on (PWM only, as
+        // PCM and SPI have a single channel).
+        queue_changed_leds(ws2811, chan, words, carry_bits, send_count);
+
+        // 1.25µs per bit at 800kHz
+        const uint32_t channel_protocol_time = ((uint64_t)send_count * array_size * 8 * 1000000) /
+                                               device->timing.freq;
+        const uint32_t channel_words = (carry_bits + (send_count * array_size * device->byte_bits) + 31) / 32;
 
         // Only using the channel which takes the longest as both run in parallel
         if (channel_protocol_time > protocol_time)
         {
             protocol_time = channel_protocol_time;
         }
+        if (channel_words > sent_words)
+        {
+            sent_words = channel_words;
+        }
+
+        shrunk |= channel->count < device->init_count[chan];
+        start_bits[chan] = carry_bits;
+        end_bits[chan] = carry_bits + (send_count * array_size * device->byte_bits);
+        carry_bits = (carry_bits + (channel->count * array_size * device->byte_bits)) % 32;
+    }
+
+    run_encode_jobs(ws2811);
 
-        for (i = 0; i < channel->count; i++)                // Led
+    // Send the whole buffer, or only up to the last changed LED followed by the reset time.
+    // A channel with fewer LEDs than at init ends early as well, rather than sending the reset
+    // time of the longest strip.  The reset of a shortened SPI frame is the idle line during
+    // render_wait_time.
+    uint32_t data_len = device->pxl_len;
+    device->tx_len = device->pxl_len;
+    if (ws2811->render_truncate || shrunk)
+    {
+        const int channels = device->pwm_channels;
+
+        data_len = ((sent_words * channels * 4) + 7) & ~7;
+        device->tx_len = data_len + ((driver_mode == SPI) ? 0 : LED_RESET_BYTE_COUNT(&device->timing) * channels);
+        if (device->tx_len > device->pxl_len)
         {
-            uint8_t color[] =
-            {
-                channel->gamma[(((channel->leds[i] >> channel->rshift) & 0xff) * scale) >> 8], // red
-                channel->gamma[(((channel->leds[i] >> channel->gshift) & 0xff) * scale) >> 8], // green
-                channel->gamma[(((channel->leds[i] >> channel->bshift) & 0xff) * scale) >> 8], // blue
-                channel->gamma[(((channel->leds[i] >> channel->wshift) & 0xff) * scale) >> 8], // white
-            };
+            data_len = device->pxl_len;
+            device->tx_len = device->pxl_len;
+        }
+    }
 
-            for (j = 0; j < array_size; j++)               // Color
-            {
-                for (k = 7; k >= 0; k--)                   // Bit
-                {
-                    // Inversion is handled by hardware for PWM, otherwise by software here
-                    uint8_t symbol = SYMBOL_LOW;
-                    if ((driver_mode != PWM) && channel->invert) symbol = SYMBOL_LOW_INV;
-
-                    if (color[j] & (1 << k))
-                    {
-                        symbol = SYMBOL_HIGH;
-                        if ((driver_mode != PWM) && channel->invert) symbol = SYMBOL_HIGH_INV;
-                    }
-
-                    for (l = 2; l >= 0; l--)               // Symbol
-                    {
-                        uint32_t *wordptr = &((uint32_t *)pxl_raw)[wordpos];   // PWM & PCM
-                        volatile uint8_t  *byteptr = &pxl_raw[bytepos];    // SPI
-
-                        if (driver_mode == SPI)
-                        {
-                            *byteptr &= ~(1 << bitpos);
-                            if (symbol & (1 << l))
-                            {
-                                *byteptr |= (1 << bitpos);
-                            }
-                        }
-                        else  // PWM & PCM
-                        {
-                            *wordptr &= ~(1 << bitpos);
-                            if (symbol & (1 << l))
-                            {
-                                *wordptr |= (1 << bitpos);
-                            }
-                        }
-
-                        bitpos--;
-                        if (bitpos < 0)
-                        {
-                            if (driver_mode == SPI)
-                            {
-                                bytepos++;
-                                bitpos = 7;
-                            }
-                            else  // PWM & PCM
-                            {
-                                // Every other word is on the same channel for PWM
-                                wordpos += (driver_mode == PWM ? 2 : 1);
-                                bitpos = 31;
-                            }
-                        }
-                    }
-                }
-            }
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        // Without both PWM channels the buffer holds the one channel set up with LEDs
+        if ((device->pwm_channels > 1) || device->init_count[chan])
+        {
+            clear_unsent_bits(device, device->pxl_next, chan, start_bits[chan], end_bits[chan], data_len);
         }
     }
+    // A frame cut short is followed by its reset time as zeros
+    for (i = data_len / sizeof(uint64_t); i < device->tx_len / sizeof(uint64_t); i++)
+    {
+        ((volatile uint64_t *)pxl_raw)[i] = 0;
+    }
+    if (driver_mode != SPI)
+    {
+        device->dma_cb[device->pxl_next]->txfr_len = device->tx_len;
+    }
 
     // Wait for any previous DMA operation to complete.
     if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
@@ -1246,30 +2072,88 @@ ws2811_return_t ws2811_render(ws2811_t *ws2811)
     }
 
     if (ws2811->render_wait_time != 0) {
-        const uint64_t current_timestamp = get_microsecond_timestamp();
-        uint64_t time_diff = current_timestamp - previous_timestamp;
-
-        if (ws2811->render_wait_time > time_diff) {
-            usleep(ws2811->render_wait_time - time_diff);
-        }
+        sleep_until(device->render_timestamp_ns + (ws2811->render_wait_time * 1000));
     }
 
-    if (driver_mode != SPI)
+    if (device->simulated)
     {
-        dma_start(ws2811);
+        ret = sim_send(device, device->pxl_next);
+    }
+    else if (driver_mode != SPI)
+    {
+        dma_start(ws2811, device->pxl_next);
     }
     else
     {
-        ret = spi_transfer(ws2811);
+        spi_queue(device, device->pxl_next, device->tx_len);
     }
+    device->pxl_next = (device->pxl_next + 1) % PXL_RAW_COUNT;
 
-    // LED_RESET_WAIT_TIME is added to allow enough time for the reset to occur.
-    previous_timestamp = get_microsecond_timestamp();
-    ws2811->render_wait_time = protocol_time + LED_RESET_WAIT_TIME;
+    device->render_timestamp_ns = get_nanosecond_timestamp();
+    device->dma_deadline_ns = device->render_timestamp_ns +
+                              ((device->wire_time_ns * device->tx_len) / device->pxl_len);
+
+    // The reset time of the timing profile is added to allow enough time for the reset to occur.
+    ws2811->render_wait_time = protocol_time + device->timing.reset_us;
+
+    device->fence++;
+    if (fence)
+    {
+        *fence = device->fence;
+    }
 
     return ret;
 }
 
+/**
+ * Check whether a frame submitted with ws2811_render_async has been sent.  Only the last
+ * submitted frame can still be in progress, all earlier ones had to finish before it started.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    fence   Fence returned by ws2811_render_async.
+ *
+ * @returns  1 once the frame has been sent or the DMA stopped on an error, 0 otherwise.
+ */
+int ws2811_fence_poll(ws2811_t *ws2811, ws2811_fence_t fence)
+{
+    volatile dma_t *dma = ws2811->device->dma;
+
+    if (fence != ws2811->device->fence)
+    {
+        return 1;
+    }
+
+    if (ws2811->device->simulated)
+    {
+        return get_nanosecond_timestamp() >= ws2811->device->dma_deadline_ns;
+    }
+
+    if (ws2811->device->driver_mode == SPI)
+    {
+        return !__atomic_load_n(&ws2811->device->spi_busy, __ATOMIC_ACQUIRE);
+    }
+
+    return !(dma->cs & RPI_DMA_CS_ACTIVE) || (dma->cs & RPI_DMA_CS_ERROR);
+}
+
+/**
+ * Wait for a frame submitted with ws2811_render_async to be sent.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    fence   Fence returned by ws2811_render_async.
+ *
+ * @returns  0 on success, -1 on DMA competion error
+ */
+ws2811_return_t ws2811_fence_wait(ws2811_t *ws2811, ws2811_fence_t fence)
+{
+    if (fence != ws2811->device->fence)
+    {
+        return WS2811_SUCCESS;
+    }
+
+    return ws2811_wait(ws2811);
+}
+
 const char * ws2811_get_return_t_str(const ws2811_return_t state)
 {
     const int index = -state;
@@ -1283,6 +2167,24 @@ const char * ws2811_get_return_t_str(const ws2811_return_t state)
     return "";
 }
 
+/**
+ * Look up a timing profile.  The freq of WS2811_TIMING_DEFAULT is 0, as it uses the freq
+ * of the ws2811_t it is selected for.
+ *
+ * @param    timing  One of the WS2811_TIMING_xxx constants.
+ *
+ * @returns  Timing profile, NULL if there is no such profile.
+ */
+const ws2811_timing_t *ws2811_get_timing(int timing)
+{
+    if ((timing < 0) || (timing >= WS2811_TIMING_COUNT))
+    {
+        return NULL;
+    }
+
+    return &timing_profiles[timing];
+}
+
 
 void ws2811_set_custom_gamma_factor(ws2811_t *ws2811, double gamma_factor)
 {
@@ -1299,7 +2201,88 @@ void ws2811_set_custom_gamma_factor(ws2811_t *ws2811, double gamma_factor)
              channel->gamma[counter] = (gamma_factor > 0)? (int)(pow((float)counter / (float)255.00, gamma_factor) * 255.00 + 0.5) : counter;
 
           }
+
+          ws2811_update_color_lut(ws2811, chan);
         }
 
     }
 }
+
+/**
+ * Change the brightness of a channel without reinitializing the driver.  The new brightness
+ * is used from the next render on.
+ *
+ * @param    ws2811      ws2811 instance pointer.
+ * @param    chan        Channel to change.
+ * @param    brightness  Brightness value between 0 and 255.
+ *
+ * @returns  None
+ */
+void ws2811_set_brightness(ws2811_t *ws2811, int chan, uint8_t brightness)
+{
+    ws2811->channel[chan].brightness = brightness;
+    ws2811_update_color_lut(ws2811, chan);
+}
+
+/**
+ * Change the number of LEDs of a channel without reinitializing the driver.  The buffers keep
+ * the size they were initialized for, so a channel can not get more LEDs than it had at init.
+ * All channels are encoded again on the next render, as the ones after it may move.  Frames
+ * end after the new count, the LEDs past it are no longer sent.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    chan    Channel to change.
+ * @param    count   Number of LEDs, at most the count at init.
+ *
+ * @returns  0 on success, WS2811_ERROR_GENERIC if the channel has no room for the LEDs.
+ */
+ws2811_return_t ws2811_set_count(ws2811_t *ws2811, int chan, int count)
+{
+    ws2811_device_t *device = ws2811->device;
+    int i;
+
+    if ((count < 0) || (count > device->init_count[chan]))
+    {
+        return WS2811_ERROR_GENERIC;
+    }
+
+    ws2811->channel[chan].count = count;
+    for (i = 0; i < RPI_PWM_CHANNELS; i++)
+    {
+        invalidate_shadow(device, i);
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Rebuild the table that maps a color byte to its brightness scaled and gamma corrected value.
+ * Render does this by itself when the brightness or the gamma table pointer changes, only
+ * edits to the gamma table contents have to be followed by a call to this.  All LEDs of the
+ * channel are encoded again on the next render.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    chan    Channel to update.
+ *
+ * @returns  None
+ */
+void ws2811_update_color_lut(ws2811_t *ws2811, int chan)
+{
+    ws2811_channel_t *channel = &ws2811->channel[chan];
+    const int scale = (channel->brightness & 0xff) + 1;
+    int x;
+
+    if (!ws2811->device || !channel->color_lut || !channel->gamma)
+    {
+        return;
+    }
+
+    for (x = 0; x < 256; x++)
+    {
+        channel->color_lut[x] = channel->gamma[(x * scale) >> 8];
+    }
+
+    ws2811->device->color_lut_brightness[chan] = channel->brightness;
+    ws2811->device->color_lut_gamma[chan] = channel->gamma;
+    invalidate_shadow(ws2811->device, chan);
+}
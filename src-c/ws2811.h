@@ -65,9 +65,38 @@ extern "C" {
 #define SK6812_STRIP                             WS2811_STRIP_GRB
 #define SK6812W_STRIP                            SK6812_STRIP_GRBW
 
+// wire timing profiles
+#define WS2811_TIMING_DEFAULT                    0        // WS2812B symbols at the freq of ws2811_t
+#define WS2811_TIMING_WS2812B                    1
+#define WS2811_TIMING_SK6812                     2
+#define WS2811_TIMING_WS2811_400K                3
+#define WS2811_TIMING_FAST                       4        // WS2812B class chips at 1MHz, short reset
+#define WS2811_TIMING_COUNT                      5
+
+// Set to run without LED hardware, see ws2811_init.  A file name as value gets every frame.
+#define WS2811_SIMULATE_ENV                      "WS2811_SIMULATE"
+#define WS2811_SIM_MAGIC                         0x4d495357  // "WSIM"
+
 struct ws2811_device;
 
 typedef uint32_t ws2811_led_t;                   //< 0xWWRRGGBB
+typedef uint64_t ws2811_fence_t;                 //< Identifies a frame submitted with ws2811_render_async
+typedef struct
+{
+    uint32_t freq;                               //< Bits per second, 0 to use the freq of ws2811_t
+    int symbols;                                 //< Symbols per bit, 3 or 4
+    uint8_t symbol_high;                         //< Symbols of a 1 bit, first one in the MSB
+    uint8_t symbol_low;                          //< Symbols of a 0 bit, first one in the MSB
+    uint32_t reset_us;                           //< Low time after a frame for the LEDs to latch it
+} ws2811_timing_t;
+typedef struct
+{
+    uint32_t magic;                              //< WS2811_SIM_MAGIC
+    uint32_t layout;                             //< Buffer layout, one of the WS2811_LAYOUT_xxx constants of encoder.h
+    uint32_t symbols;                            //< Symbols per bit
+    uint32_t len;                                //< Bytes of the frame following the header
+    uint32_t gpionum;                            //< GPIO of the first channel with LEDs, tells apart the drivers sharing a file
+} ws2811_sim_header_t;                           //< In front of every frame a simulated driver writes
 typedef struct ws2811_channel_t
 {
     int gpionum;                                 //< GPIO Pin with PWM alternate function, 0 if unused
@@ -75,12 +104,15 @@ typedef struct ws2811_channel_t
     int count;                                   //< Number of LEDs, 0 if channel is unused
     int strip_type;                              //< Strip color layout -- one of WS2811_STRIP_xxx constants
     ws2811_led_t *leds;                          //< LED buffers, allocated by driver based on count
+    const uint32_t *map;                         //< If set, LED i shows source[map[i]] instead of leds[i]
+    const ws2811_led_t *source;                  //< Colors read through map, in any order and may be shared
     uint8_t brightness;                          //< Brightness value between 0 and 255
     uint8_t wshift;                              //< White shift value
     uint8_t rshift;                              //< Red shift value
     uint8_t gshift;                              //< Green shift value
     uint8_t bshift;                              //< Blue shift value
     uint8_t *gamma;                              //< Gamma correction table
+    uint8_t *color_lut;                          //< Brightness and gamma combined, built by driver
 } ws2811_channel_t;
 
 typedef struct ws2811_t
@@ -90,6 +122,8 @@ typedef struct ws2811_t
     const rpi_hw_t *rpi_hw;                      //< RPI Hardware Information
     uint32_t freq;                               //< Required output frequency
     int dmanum;                                  //< DMA number _not_ already in use
+    int render_truncate;                         //< Only send LEDs up to the last one that changed
+    int timing;                                  //< Wire timing profile -- one of WS2811_TIMING_xxx constants
     ws2811_channel_t channel[RPI_PWM_CHANNELS];
 } ws2811_t;
 
@@ -108,7 +142,8 @@ typedef struct ws2811_t
             X(-11, WS2811_ERROR_ILLEGAL_GPIO, "Selected GPIO not possible"),                \
             X(-12, WS2811_ERROR_PCM_SETUP, "Unable to initialize PCM"),                     \
             X(-13, WS2811_ERROR_SPI_SETUP, "Unable to initialize SPI"),                     \
-            X(-14, WS2811_ERROR_SPI_TRANSFER, "SPI transfer error")                         \
+            X(-14, WS2811_ERROR_SPI_TRANSFER, "SPI transfer error"),                        \
+            X(-15, WS2811_ERROR_TIMING, "Unknown timing profile")                           \
 
 #define WS2811_RETURN_STATES_ENUM(state, name, str) name = state
 #define WS2811_RETURN_STATES_STRING(state, name, str) str
@@ -123,9 +158,16 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811);
 uint64_t get_microsecond_timestamp();
 void ws2811_fini(ws2811_t *ws2811);                                             //< Tear it all down
 ws2811_return_t ws2811_render(ws2811_t *ws2811);                                //< Send LEDs off to hardware
+ws2811_return_t ws2811_render_async(ws2811_t *ws2811, ws2811_fence_t *fence);   //< Send LEDs off to hardware, fence identifies the frame
+int ws2811_fence_poll(ws2811_t *ws2811, ws2811_fence_t fence);                  //< Non-zero once the frame of the fence has been sent
+ws2811_return_t ws2811_fence_wait(ws2811_t *ws2811, ws2811_fence_t fence);      //< Wait until the frame of the fence has been sent
 ws2811_return_t ws2811_wait(ws2811_t *ws2811);                                  //< Wait for DMA completion
 const char * ws2811_get_return_t_str(const ws2811_return_t state);              //< Get string representation of the given return state
 void ws2811_set_custom_gamma_factor(ws2811_t *ws2811, double gamma_factor);     //< Set a custom Gamma correction array based on a gamma correction factor
+void ws2811_set_brightness(ws2811_t *ws2811, int chan, uint8_t brightness);     //< Change the brightness of a channel, applied on the next render
+void ws2811_update_color_lut(ws2811_t *ws2811, int chan);                       //< Rebuild the color table after editing the gamma table in place
+ws2811_return_t ws2811_set_count(ws2811_t *ws2811, int chan, int count);        //< Change the LED count of a channel, up to the count at init
+const ws2811_timing_t *ws2811_get_timing(int timing);                            //< Symbols and reset time of a timing profile, NULL if unknown
 
 #ifdef __cplusplus
 }
@@ -14,9 +14,22 @@ export function ignoreSudoCheck() {
 }
 
 interface CApi {
-    initMatrix(width: number, height: number, brightness: number): boolean;
+    initMatrix(
+        width: number,
+        height: number,
+        brightness: number,
+        timing: LedTiming,
+        layout: LedLayout,
+        panels: number[],
+        outputs: LedOutputs,
+    ): boolean;
     drawStill(width: number, height: number, brightness: number, colors: number[]): boolean;
     drawFrame(colors: number[]): boolean;
+    drawFrameAsync(colors: number[]): number;
+    pollFrame(fence: number): boolean;
+    waitFrame(fence: number): boolean;
+    skippedFrameCount(): number;
+    setBrightness(brightness: number): boolean;
     cleanUp(): boolean;
     test(): string;
 }
@@ -68,9 +81,9 @@ export type DrawStillInputs = {
 
 /**
  * Draws an image to the LED board. Automatically initializes the board using the size of the given
- * image matrix. This is only medium performance drawing because it has a convenient API and
- * automatically initializes the LED board on each run. For higher performance drawing, use
- * drawFrame (which requires the LED board to be initialized first).
+ * image matrix. The board is only initialized again when it was initialized with other settings
+ * or for fewer LEDs than the image has, otherwise this is about as fast as drawFrame. Drawing
+ * with drawFrame keeps the timing, layout, panels and outputs given to initLedBoard.
  *
  * @returns True on draw success, otherwise false
  */
@@ -86,11 +99,101 @@ export function drawStillImage({brightness, imageMatrix}: DrawStillInputs): bool
     return result;
 }
 
+/**
+ * Wire timing of the LED chips. Chips that latch with a shorter reset or accept a higher bit rate
+ * allow more frames per second.
+ */
+export enum LedTiming {
+    /** WS2812B timing at 800 kHz. */
+    Default = 0,
+    /** 800 kHz, 300 µs reset. */
+    Ws2812b = 1,
+    /** 800 kHz with shorter high times, 80 µs reset. */
+    Sk6812 = 2,
+    /** 400 kHz, 55 µs reset. */
+    Ws2811_400k = 3,
+    /** WS2812B class chips pushed to 1 MHz, 55 µs reset. Not all chips keep up. */
+    Fast = 4,
+}
+
+/**
+ * How the LED strip runs through the panel. Combine one of Rows or Columns with any of the other
+ * flags using `|`. Without any flags, the strip starts in the top left corner of the panel and runs
+ * along each row from left to right.
+ */
+export enum LedLayout {
+    /** The strip runs along the rows of the panel. */
+    Rows = 0,
+    /** The strip runs along the columns of the panel. */
+    Columns = 1 << 0,
+    /** Every second row or column runs backwards, instead of all running the same way. */
+    Serpentine = 1 << 1,
+    /** The strip starts on the right side of the panel. */
+    FlipX = 1 << 2,
+    /** The strip starts on the bottom of the panel. */
+    FlipY = 1 << 3,
+    /** The panel is mounted turned clockwise by 90 degrees. */
+    Rotate90 = 1 << 4,
+    /** The panel is mounted upside down. */
+    Rotate180 = 2 << 4,
+    /** The panel is mounted turned counterclockwise by 90 degrees. */
+    Rotate270 = 3 << 4,
+    /** Columns in a serpentine, starting in the bottom right corner. */
+    Default = Columns | Serpentine | FlipX | FlipY,
+}
+
+/** One of several panels chained on the same data line that together make up the LED board. */
+export type LedPanel = {
+    /** Column of the board where the panel's left edge is. */
+    x: number;
+    /** Row of the board where the panel's top edge is. */
+    y: number;
+    /** Columns of the board the panel covers, after any rotation. */
+    width: number;
+    /** Rows of the board the panel covers, after any rotation. */
+    height: number;
+    /** How the LED strip runs through this panel. Defaults to LedLayout.Default. */
+    layout?: LedLayout;
+};
+
+/**
+ * Outputs the LED board is sent on. Sending takes longer the more LEDs there are on an output, so
+ * splitting the board across two outputs nearly doubles the frames per second when both parts are
+ * about as long. The chain of panels is cut at the end of a row or column of a panel's strip where
+ * both parts are closest in length, which can be inside a panel. The first part stays on GPIO 18.
+ * LedOutputs.Parallel does not cut the chain but sends each panel on an output of its own.
+ */
+export enum LedOutputs {
+    /** The whole board on GPIO 18. */
+    Single = 0,
+    /** The rest of the board on GPIO 13, the second PWM channel. */
+    DualPwm = 1,
+    /** The rest of the board on GPIO 10, over SPI. */
+    PwmAndSpi = 2,
+    /**
+     * Every panel on a GPIO of its own, all sent at once, so a frame takes as long as the largest
+     * panel. Up to 16 panels, on GPIO 18, 13, 12, 19, 5, 6, 16, 17 and 20 to 27 in panel order.
+     */
+    Parallel = 3,
+}
+
 export type InitInputs = {
     /** Brightness of the LEDs. */
     brightness: number;
     /** Size of the LED matrix in LED count. */
     dimensions: MatrixDimensions;
+    /** Wire timing of the LED chips. Defaults to LedTiming.Default. */
+    timing?: LedTiming;
+    /** How the LED strip runs through the panel. Defaults to LedLayout.Default. */
+    layout?: LedLayout;
+    /**
+     * Panels chained on the data line, in the order the data passes through them. The dimensions
+     * are then those of the whole board, which the panels are placed on. Defaults to a single
+     * panel covering the whole board with the given layout.
+     */
+    panels?: LedPanel[];
+    /** Outputs the board is split across. Defaults to LedOutputs.Single. */
+    outputs?: LedOutputs;
 };
 
 /**
@@ -99,10 +202,35 @@ export type InitInputs = {
  *
  * @returns True on init success, otherwise false
  */
-export function initLedBoard({brightness, dimensions}: InitInputs): boolean {
+export function initLedBoard({
+    brightness,
+    dimensions,
+    timing = LedTiming.Default,
+    layout = LedLayout.Default,
+    panels = [],
+    outputs = LedOutputs.Single,
+}: InitInputs): boolean {
     validateBrightness(brightness);
+    const boardPanels: LedPanel[] = panels.length
+        ? panels
+        : [{x: 0, y: 0, width: dimensions.width, height: dimensions.height, layout}];
+    const flatPanels = boardPanels.flatMap((panel) => [
+        panel.x,
+        panel.y,
+        panel.width,
+        panel.height,
+        panel.layout ?? LedLayout.Default,
+    ]);
     const result = makeApiCall((api) =>
-        api.initMatrix(dimensions.width, dimensions.height, brightness),
+        api.initMatrix(
+            dimensions.width,
+            dimensions.height,
+            brightness,
+            timing,
+            layout,
+            flatPanels,
+            outputs,
+        ),
     );
     if (!result) {
         throw new Ws2812drawError(`initialization failed`);
@@ -132,8 +260,64 @@ export function drawFrame(imageMatrix: number[][]): boolean {
 }
 
 /**
- * Uses drawStillImage (thus this has lower performance than drawFrame) to conveniently fill the
- * whole LED board with a single color.
+ * Changes the brightness of an initialized LED board without re-initializing it. The frame that is
+ * currently shown is redrawn with the new brightness, so this can be used for fading.
+ *
+ * @returns True on success, otherwise false
+ */
+export function setBrightness(brightness: number): boolean {
+    validateBrightness(brightness);
+    const result = makeApiCall((api) => api.setBrightness(brightness));
+    if (!result) {
+        throw new Ws2812drawError(`must be initialized before setting brightness`);
+    }
+    return result;
+}
+
+/**
+ * Starts drawing the given image to the LED board without waiting for it to finish being sent. This
+ * allows the next frame to be generated while the current one is still being sent to the LEDs. Like
+ * drawFrame, initLedBoard must be called before this is called.
+ *
+ * @param imageMatrix The matrix of colors to draw. The dimensions of this matrix should match those
+ *   previously passed to initLedBoard.
+ * @returns A frame fence which can be passed to isFrameDone or waitForFrame.
+ */
+export function drawFrameAsync(imageMatrix: number[][]): number {
+    return makeApiCall((api) => api.drawFrameAsync(flattenMatrix(imageMatrix)));
+}
+
+/**
+ * Checks if a frame started by drawFrameAsync has finished being sent to the LED board.
+ *
+ * @param fence The frame fence returned by drawFrameAsync.
+ */
+export function isFrameDone(fence: number): boolean {
+    return makeApiCall((api) => api.pollFrame(fence));
+}
+
+/**
+ * Blocks until a frame started by drawFrameAsync has finished being sent to the LED board.
+ *
+ * @param fence The frame fence returned by drawFrameAsync.
+ */
+export function waitForFrame(fence: number): void {
+    const result = makeApiCall((api) => api.waitFrame(fence));
+    if (!result) {
+        throw new Ws2812drawError(`failed to wait for frame ${fence}`);
+    }
+}
+
+/**
+ * Counts the frames given to drawFrame or drawFrameAsync that were skipped because they were
+ * identical to the frame already on the LED board (same colors, brightness and gamma).
+ */
+export function getSkippedFrameCount(): number {
+    return makeApiCall((api) => api.skippedFrameCount());
+}
+
+/**
+ * Uses drawStillImage to conveniently fill the whole LED board with a single color.
  */
 export function drawSolidColor({
     brightness,
@@ -0,0 +1,20 @@
+import {drawFrameAsync, isFrameDone, LedColor, waitForFrame} from '..';
+
+const fence = drawFrameAsync([
+    [
+        LedColor.Black,
+        LedColor.Red,
+        LedColor.Orange,
+    ],
+    [
+        LedColor.Black,
+        LedColor.Red,
+        LedColor.Orange,
+    ],
+]);
+
+// generate the next frame here while the current one is being sent
+
+if (!isFrameDone(fence)) {
+    waitForFrame(fence);
+}
@@ -0,0 +1,3 @@
+import {getSkippedFrameCount} from '..';
+
+console.log(`${getSkippedFrameCount()} frames were already on the board`);
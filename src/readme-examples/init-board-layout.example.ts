@@ -0,0 +1,11 @@
+import {initLedBoard, LedLayout} from '..';
+
+initLedBoard({
+    brightness: 100,
+    dimensions: {
+        width: 32,
+        height: 8,
+    },
+    // rows in a serpentine, starting in the top left corner, on a panel that is mounted upside down
+    layout: LedLayout.Rows | LedLayout.Serpentine | LedLayout.Rotate180,
+});
@@ -0,0 +1,17 @@
+import {initLedBoard, LedOutputs} from '..';
+
+// four 32x8 panels, the first two on GPIO 18 and the last two on GPIO 13
+initLedBoard({
+    brightness: 100,
+    dimensions: {
+        width: 32,
+        height: 32,
+    },
+    panels: [
+        {x: 0, y: 0, width: 32, height: 8},
+        {x: 0, y: 8, width: 32, height: 8},
+        {x: 0, y: 16, width: 32, height: 8},
+        {x: 0, y: 24, width: 32, height: 8},
+    ],
+    outputs: LedOutputs.DualPwm,
+});
@@ -0,0 +1,14 @@
+import {initLedBoard, LedLayout} from '..';
+
+// two 32x8 panels stacked into a 32x16 board, the lower one mounted upside down
+initLedBoard({
+    brightness: 100,
+    dimensions: {
+        width: 32,
+        height: 16,
+    },
+    panels: [
+        {x: 0, y: 0, width: 32, height: 8},
+        {x: 0, y: 8, width: 32, height: 8, layout: LedLayout.Default | LedLayout.Rotate180},
+    ],
+});
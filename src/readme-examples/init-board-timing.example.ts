@@ -0,0 +1,10 @@
+import {initLedBoard, LedTiming} from '..';
+
+initLedBoard({
+    brightness: 100,
+    dimensions: {
+        width: 32,
+        height: 8,
+    },
+    timing: LedTiming.Sk6812,
+});
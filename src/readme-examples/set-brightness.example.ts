@@ -0,0 +1,4 @@
+import {setBrightness} from '..';
+
+// must be between 0 and 255 inclusive
+setBrightness(50);
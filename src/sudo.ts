@@ -1,4 +1,8 @@
 export function checkSudo(): void {
+    // a simulated LED board doesn't touch any hardware
+    if (process.env.WS2811_SIMULATE !== undefined) {
+        return;
+    }
     const isSudo = !!process.env.SUDO_UID;
     if (!isSudo) {
         console.error(`